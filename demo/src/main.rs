@@ -1,5 +1,7 @@
+use std::convert::TryFrom;
 use std::error::Error;
 use std::net::{IpAddr, SocketAddr};
+use std::path::PathBuf;
 use std::str::FromStr;
 use std::sync::Arc;
 
@@ -16,8 +18,10 @@ use media_server::sdp::enums::{FingerprintHashFunction, IceCandidateType, IceTra
 use media_server::sdp::types::CertificateFingerprint;
 use media_server::sdp::webrtc::{MediaDirection, RtpEncoding, RtpMediaDescription, UnifiedBundleSession};
 use media_server::{
-    DtlsConnectionHash, LoggingLevel, MediaFrameType, Properties, RtpBundleTransport, RtpBundleTransportConnection,
-    RtpIncomingSourceGroup, RtpOutgoingSourceGroup, RtpStreamTransponder,
+    DtlsCertificateKeyType, DtlsConnectionHash, IceTransportParameters, LoggingLevel, MediaFrameType,
+    RtpBundleTransportConnection, RtpBundleTransportPool, RtpCodecParameters, RtpExtensionParameters,
+    RtpIncomingSourceGroup, RtpIncomingSourceGroupParameters, RtpMediaParameters, RtpOutgoingSourceGroup,
+    RtpOutgoingSourceGroupParameters, RtpStreamTransponder,
 };
 
 #[derive(Debug, Clone, StructOpt)]
@@ -28,6 +32,9 @@ struct Opts {
     public_ip: IpAddr,
     #[structopt(short = "r", long, parse(try_from_str = parse_port_range))]
     port_range: Option<(u16, u16)>,
+    /// Directory to keep the DTLS certificate in across restarts, generated on first run.
+    #[structopt(long, parse(from_os_str))]
+    certificate_dir: Option<PathBuf>,
 }
 
 fn parse_port_range(s: &str) -> Result<(u16, u16), String> {
@@ -66,50 +73,63 @@ async fn send_message(websocket: &mut warp::ws::WebSocket, message: &S2CMessage)
     Ok(())
 }
 
-fn add_rtp_properties_from_media_description(properties: &mut Properties, media_description: &RtpMediaDescription) {
-    let kind = &media_description.kind;
-
-    for (i, payload) in media_description.payloads.iter().enumerate() {
-        properties.set_string(&format!("{}.codecs.{}.codec", kind, i), payload.name.as_ref());
-        properties.set_int(&format!("{}.codecs.{}.pt", kind, i), payload.payload_type.0 as i32);
+/// Codec and extension parameters for the first media description of each kind.
+struct RtpParameters<'a> {
+    audio_codecs: Vec<RtpCodecParameters<'a>>,
+    audio_extensions: Vec<RtpExtensionParameters<'a>>,
+    video_codecs: Vec<RtpCodecParameters<'a>>,
+    video_extensions: Vec<RtpExtensionParameters<'a>>,
+}
 
-        if let Some(rtx_payload_type) = payload.rtx_payload_type {
-            properties.set_int(&format!("{}.codecs.{}.rtx", kind, i), rtx_payload_type.0 as i32);
+impl<'a> RtpParameters<'a> {
+    fn audio(&self) -> RtpMediaParameters {
+        RtpMediaParameters {
+            codecs: &self.audio_codecs,
+            extensions: &self.audio_extensions,
         }
     }
 
-    properties.set_int(
-        &format!("{}.codecs.length", kind),
-        media_description.payloads.len() as i32,
-    );
-
-    for (i, (uri, id)) in media_description.extensions.iter().enumerate() {
-        properties.set_int(&format!("{}.ext.{}.id", kind, i), *id as i32);
-        properties.set_string(&format!("{}.ext.{}.uri", kind, i), uri);
+    fn video(&self) -> RtpMediaParameters {
+        RtpMediaParameters {
+            codecs: &self.video_codecs,
+            extensions: &self.video_extensions,
+        }
     }
+}
 
-    properties.set_int(
-        &format!("{}.ext.length", kind),
-        media_description.extensions.len() as i32,
-    );
+fn get_rtp_codecs_from_media_description(media_description: Option<&RtpMediaDescription>) -> Vec<RtpCodecParameters> {
+    media_description
+        .iter()
+        .flat_map(|md| md.payloads.iter())
+        .map(|payload| RtpCodecParameters {
+            name: payload.name.as_ref(),
+            payload_type: payload.payload_type.0,
+            rtx_payload_type: payload.rtx_payload_type.map_or(0, |pt| pt.0),
+        })
+        .collect()
 }
 
-fn get_rtp_properties_from_sdp(sdp: &UnifiedBundleSession) -> Properties {
-    let mut properties = Properties::new();
+fn get_rtp_extensions_from_media_description(
+    media_description: Option<&RtpMediaDescription>,
+) -> Vec<RtpExtensionParameters> {
+    media_description
+        .iter()
+        .flat_map(|md| md.extensions.iter())
+        // media-server only takes one-byte ids, skip anything that doesn't fit rather than truncate it.
+        .filter_map(|(uri, id)| u8::try_from(*id).ok().map(|id| RtpExtensionParameters { id, uri }))
+        .collect()
+}
 
+fn get_rtp_parameters_from_sdp(sdp: &UnifiedBundleSession) -> RtpParameters {
     let first_audio_media = sdp.media_descriptions.iter().find(|md| md.kind == MediaType::Audio);
-
-    if let Some(media_description) = first_audio_media {
-        add_rtp_properties_from_media_description(&mut properties, media_description);
-    }
-
     let first_video_media = sdp.media_descriptions.iter().find(|md| md.kind == MediaType::Video);
 
-    if let Some(media_description) = first_video_media {
-        add_rtp_properties_from_media_description(&mut properties, media_description);
+    RtpParameters {
+        audio_codecs: get_rtp_codecs_from_media_description(first_audio_media),
+        audio_extensions: get_rtp_extensions_from_media_description(first_audio_media),
+        video_codecs: get_rtp_codecs_from_media_description(first_video_media),
+        video_extensions: get_rtp_extensions_from_media_description(first_video_media),
     }
-
-    properties
 }
 
 /// Filters the codecs, rtcp feedbacks, and extensions in the SDP according to
@@ -175,7 +195,6 @@ fn filter_answer_to_capabilities(sdp: &mut UnifiedBundleSession) {
 
 #[allow(dead_code)]
 struct ActiveSession {
-    transport: RtpBundleTransport,
     connection: RtpBundleTransportConnection,
     incoming_source_groups: Vec<RtpIncomingSourceGroup>,
     outgoing_source_groups: Vec<RtpOutgoingSourceGroup>,
@@ -184,6 +203,7 @@ struct ActiveSession {
 
 async fn handle_offer(
     opts: Arc<Opts>,
+    pool: Arc<RtpBundleTransportPool>,
     websocket: &mut warp::ws::WebSocket,
     offer: &UnifiedBundleSession,
 ) -> Result<ActiveSession, Box<dyn Error>> {
@@ -195,13 +215,14 @@ async fn handle_offer(
     //       so we're just gonna use the raw native API to get something running here,
     //       and use it to guide implementation of those APIs later.
 
-    // TODO: We shouldn't be creating one RtpBundleTransport (Endpoint) per connection.
-    let mut transport = RtpBundleTransport::new(None)?;
-
     // This will generate a new ice ufrag/pwd,
     // we need to add our ICE candidates and DTLS fingerprint.
     let mut answer = offer.answer();
 
+    // The pool picks the transport (and so the port) for a connection from the ICE username.
+    let username = answer.ice_ufrag.clone() + ":" + &offer.ice_ufrag;
+    let port = pool.get_local_port(&username);
+
     filter_answer_to_capabilities(&mut answer);
 
     answer.ice_lite = true;
@@ -212,7 +233,7 @@ async fn handle_offer(
         transport: IceTransportType::Udp,
         priority: (2u32.pow(24) * 126) + (2u32.pow(8) * (65535 - 1)) + 255,
         address: opts.public_ip.to_string(),
-        port: transport.get_local_port(),
+        port,
         kind: IceCandidateType::Host,
         rel_addr: None,
         rel_port: None,
@@ -232,29 +253,36 @@ async fn handle_offer(
         .get(&FingerprintHashFunction::Sha256)
         .ok_or("sha-256 dtls fingerprint missing from offer")?;
 
-    let mut properties = Properties::new();
-    properties.set_string("ice.localUsername", &answer.ice_ufrag);
-    properties.set_string("ice.localPassword", &answer.ice_pwd);
-    properties.set_string("ice.remoteUsername", &offer.ice_ufrag);
-    properties.set_string("ice.remotePassword", &offer.ice_pwd);
-    properties.set_string("dtls.setup", offer.setup_role.as_ref());
-    properties.set_string("dtls.hash", "SHA-256");
-    properties.set_string("dtls.fingerprint", &offer_fingerprint.to_string());
-    properties.set_bool("disableSTUNKeepAlive", false);
-    properties.set_string("srtpProtectionProfiles", "");
-
-    let username = answer.ice_ufrag.clone() + ":" + &offer.ice_ufrag;
-    let mut connection = transport.add_ice_transport(username.as_str(), &properties)?;
-
-    let remote_properties = get_rtp_properties_from_sdp(offer);
-    connection.set_remote_properties(&remote_properties);
+    let offer_fingerprint = offer_fingerprint.to_string();
+    let parameters = IceTransportParameters {
+        local_username: &answer.ice_ufrag,
+        local_password: &answer.ice_pwd,
+        remote_username: &offer.ice_ufrag,
+        remote_password: &offer.ice_pwd,
+        dtls_setup: offer.setup_role.as_ref(),
+        dtls_hash: "SHA-256",
+        dtls_fingerprint: &offer_fingerprint,
+        disable_stun_keep_alive: false,
+        srtp_protection_profiles: &[],
+    };
+
+    let mut connection = pool.add_ice_transport_with_parameters(username.as_str(), &parameters)?;
+    log::debug!("transport shard stats: {:?}", pool.get_shard_stats());
+
+    let remote_parameters = get_rtp_parameters_from_sdp(offer);
+    connection.set_remote_rtp_parameters(&remote_parameters.audio(), &remote_parameters.video());
+
+    // The answer is modified below, so the local parameters can't keep borrowing from it.
+    {
+        let local_parameters = get_rtp_parameters_from_sdp(&answer);
+        connection.set_local_rtp_parameters(&local_parameters.audio(), &local_parameters.video());
+    }
 
-    let local_properties = get_rtp_properties_from_sdp(&answer);
-    connection.set_local_properties(&local_properties);
+    let mut incoming_parameters = Vec::new();
+    let mut outgoing_parameters = Vec::new();
 
-    let mut incoming_source_groups = Vec::new();
-    let mut outgoing_source_groups = Vec::new();
-    let mut transponders = Vec::new();
+    // Pairs of (incoming, outgoing) indexes to connect with a transponder.
+    let mut transponder_links = Vec::new();
 
     // TODO: We've got a weird bug here where media-server isn't matching up the RTX
     //       packets with an encoding - both the MID and RID headers seems to be missing.
@@ -273,27 +301,29 @@ async fn handle_offer(
             _ => continue,
         };
 
-        let mut outgoing_source_group = None;
+        let mut has_outgoing_source_group = false;
 
         for encoding in &media_description.encodings {
-            let mut incoming_source_group = match encoding {
-                RtpEncoding::Rid { rid, .. } => connection.add_incoming_source_group(
-                    frame_type,
-                    Some(&media_description.mid.0),
-                    Some(&rid.0),
-                    None,
-                    None,
-                )?,
-                RtpEncoding::SendingSsrc { ssrc, rtx_ssrc, .. } => connection.add_incoming_source_group(
-                    frame_type,
-                    Some(&media_description.mid.0),
-                    None,
-                    Some(ssrc.0),
-                    rtx_ssrc.map(|s| s.0),
-                )?,
-            };
-
-            if media_description.direction == MediaDirection::SendReceive && outgoing_source_group.is_none() {
+            let incoming_index = incoming_parameters.len();
+
+            incoming_parameters.push(match encoding {
+                RtpEncoding::Rid { rid, .. } => RtpIncomingSourceGroupParameters {
+                    kind: frame_type,
+                    mid: &media_description.mid.0,
+                    rid: &rid.0,
+                    media_ssrc: 0,
+                    rtx_ssrc: 0,
+                },
+                RtpEncoding::SendingSsrc { ssrc, rtx_ssrc, .. } => RtpIncomingSourceGroupParameters {
+                    kind: frame_type,
+                    mid: &media_description.mid.0,
+                    rid: "",
+                    media_ssrc: ssrc.0,
+                    rtx_ssrc: rtx_ssrc.map_or(0, |s| s.0),
+                },
+            });
+
+            if media_description.direction == MediaDirection::SendReceive && !has_outgoing_source_group {
                 let mut rng = rand::thread_rng();
 
                 let media_ssrc = rng.gen();
@@ -303,20 +333,16 @@ async fn handle_offer(
                     None
                 };
 
-                let mut new_outgoing_source_group = connection.add_outgoing_source_group(
-                    frame_type,
-                    Some(&media_description.mid.0),
-                    media_ssrc,
-                    rtx_ssrc,
-                )?;
+                transponder_links.push((incoming_index, outgoing_parameters.len()));
 
-                let mut transponder = new_outgoing_source_group.add_transponder();
-
-                transponder.set_incoming(&mut incoming_source_group);
-
-                transponders.push(transponder);
+                outgoing_parameters.push(RtpOutgoingSourceGroupParameters {
+                    kind: frame_type,
+                    mid: &media_description.mid.0,
+                    media_ssrc,
+                    rtx_ssrc: rtx_ssrc.unwrap_or(0),
+                });
 
-                outgoing_source_group = Some(new_outgoing_source_group);
+                has_outgoing_source_group = true;
 
                 let answer_media_description = answer.media_descriptions.get_mut(i).unwrap();
 
@@ -337,21 +363,26 @@ async fn handle_offer(
                     rtx_ssrc: rtx_ssrc.map(|v| v.into()),
                 });
             }
-
-            incoming_source_groups.push(incoming_source_group);
-        }
-
-        if let Some(outgoing_source_group) = outgoing_source_group {
-            outgoing_source_groups.push(outgoing_source_group);
         }
     }
 
+    let (mut incoming_source_groups, mut outgoing_source_groups) =
+        connection.add_source_groups(&incoming_parameters, &outgoing_parameters)?;
+
+    let transponders = transponder_links
+        .into_iter()
+        .map(|(incoming_index, outgoing_index)| {
+            let mut transponder = outgoing_source_groups[outgoing_index].add_transponder();
+            transponder.set_incoming(&mut incoming_source_groups[incoming_index]);
+            transponder
+        })
+        .collect();
+
     // TODO: Mirror back the tracks?
 
     send_message(websocket, &S2CMessage::Answer { sdp: answer }).await?;
 
     Ok(ActiveSession {
-        transport,
         connection,
         incoming_source_groups,
         outgoing_source_groups,
@@ -359,7 +390,7 @@ async fn handle_offer(
     })
 }
 
-async fn on_websocket_upgrade(opts: Arc<Opts>, mut websocket: warp::ws::WebSocket) {
+async fn on_websocket_upgrade(opts: Arc<Opts>, pool: Arc<RtpBundleTransportPool>, mut websocket: warp::ws::WebSocket) {
     // Stores the media-server objects for the current websocket
     let mut session = None;
 
@@ -393,7 +424,7 @@ async fn on_websocket_upgrade(opts: Arc<Opts>, mut websocket: warp::ws::WebSocke
         match parsed {
             C2SMessage::Heartbeat => continue,
             C2SMessage::Offer { sdp } => {
-                match handle_offer(opts.clone(), &mut websocket, &sdp).await {
+                match handle_offer(opts.clone(), pool.clone(), &mut websocket, &sdp).await {
                     Ok(new_session) => session.replace(new_session),
                     Err(e) => {
                         log::warn!("failed to handle offer: {}", e);
@@ -414,18 +445,30 @@ async fn main() {
     let opts_filter_clone = opts.clone();
     let opts_filter = warp::any().map(move || opts_filter_clone.clone());
 
-    media_server::library_init(LoggingLevel::Debug).unwrap();
+    if let Some(certificate_dir) = &opts.certificate_dir {
+        let cert_path = certificate_dir.join("dtls-cert.pem");
+        let key_path = certificate_dir.join("dtls-key.pem");
+        media_server::use_dtls_certificate(&cert_path, &key_path, DtlsCertificateKeyType::EcdsaP256).unwrap();
+    }
+
+    media_server::library_init(LoggingLevel::Debug, DtlsCertificateKeyType::EcdsaP256).unwrap();
 
     if opts.port_range.is_some() {
         media_server::set_port_range(opts.port_range).unwrap();
     }
 
+    let pool = Arc::new(RtpBundleTransportPool::new(None).unwrap());
+    let pool_filter = warp::any().map(move || pool.clone());
+
     let websocket = warp::get()
         .and(warp::path::path("ws"))
         .and(warp::path::end())
         .and(warp::ws())
         .and(opts_filter)
-        .map(|ws: warp::ws::Ws, opts: Arc<Opts>| ws.on_upgrade(|w| on_websocket_upgrade(opts, w)));
+        .and(pool_filter)
+        .map(|ws: warp::ws::Ws, opts: Arc<Opts>, pool: Arc<RtpBundleTransportPool>| {
+            ws.on_upgrade(|w| on_websocket_upgrade(opts, pool, w))
+        });
 
     let index = warp::get()
         .and(warp::path::end())
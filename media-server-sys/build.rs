@@ -149,6 +149,7 @@ fn main() {
         .define("HAVE_STRING_H", None)
         .define("TESTAPP_SOURCE", None)
         .define("OPENSSL", None)
+        .define("GCM", None)
         .define("HAVE_INT16_T", None)
         .define("HAVE_INT32_T", None)
         .define("HAVE_INT8_T", None)
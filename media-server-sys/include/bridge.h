@@ -1,8 +1,12 @@
 #pragma once
 #include "rust/cxx.h"
 
+#include <atomic>
+#include <mutex>
+
 #include "DTLSICETransport.h"
 #include "RTPBundleTransport.h"
+#include "rtp/RTPIncomingMediaStreamDepacketizer.h"
 #include "rtp/RTPStreamTransponder.h"
 
 using DtlsConnectionHash = DTLSConnection::Hash;
@@ -17,17 +21,49 @@ void logger_enable_ultra_debug(bool flag);
 
 void openssl_class_init();
 
-void dtls_connection_initialize();
+enum class DtlsCertificateKeyType : uint8_t;
+
+// Has to be called before dtls_connection_initialize, which otherwise generates a new certificate.
+void dtls_connection_set_certificate(rust::Str cert_path, rust::Str key_path);
+
+// Writes a new self-signed certificate and private key as PEM files, the key readable only by us.
+void dtls_connection_ensure_certificate(rust::Str cert_path, rust::Str key_path, DtlsCertificateKeyType key_type);
+
+// Uses the certificate from dtls_connection_set_certificate if there was one, otherwise a new one
+// with the given key type.
+void dtls_connection_initialize(DtlsCertificateKeyType key_type);
+
+// Runs `handshakes` full (EC)DHE handshakes between an in-memory client and server using a
+// certificate of the given key type, returning the total time taken in nanoseconds.
+uint64_t dtls_certificate_handshake_benchmark(DtlsCertificateKeyType key_type, size_t handshakes);
 
 rust::String dtls_connection_get_certificate_fingerprint(DtlsConnectionHash hash);
 
 void rtp_transport_set_port_range(uint16_t min, uint16_t max);
 
+enum class SrtpProtectionProfile : uint8_t;
+struct SrtpBenchmarkResult;
+
+// Protects and then unprotects `packets` packets of `payload_size` bytes with a local libsrtp
+// session, for comparing the cost of each profile.
+SrtpBenchmarkResult srtp_benchmark(SrtpProtectionProfile profile, size_t payload_size, size_t packets);
+
+struct TeardownCompletionRustAdapter;
+
+// Facades never destroy media-server objects on the calling thread, as removing them has to wait
+// on the event loop. This completes once everything released before the call has been torn down.
+void teardown_flush(rust::Box<TeardownCompletionRustAdapter> completion);
+
 struct PropertiesFacade {
+    PropertiesFacade() = default;
+    explicit PropertiesFacade(Properties properties);
     operator const Properties &() const;
     void set_int(rust::Str key, int value);
     void set_bool(rust::Str key, bool value);
     void set_string(rust::Str key, rust::Str value);
+    int get_int(rust::Str key) const;
+    bool get_bool(rust::Str key) const;
+    rust::String get_string(rust::Str key) const;
 
 private:
     Properties properties;
@@ -35,35 +71,143 @@ private:
 
 std::unique_ptr<PropertiesFacade> new_properties();
 
-struct DtlsIceTransportListenerRustAdapter;
+struct IceTransportParameters;
+struct RtpMediaParameters;
+
+std::unique_ptr<PropertiesFacade> new_ice_transport_properties(const IceTransportParameters &parameters);
+std::unique_ptr<PropertiesFacade> new_rtp_properties(const RtpMediaParameters &audio, const RtpMediaParameters &video);
+
+struct DtlsIceTransportEvent;
+struct DtlsIceTransportEventQueueStats;
+struct DtlsIceTransportEventNotifierRustAdapter;
+struct DtlsIceTransportEventQueue;
 struct DtlsIceTransportListenerCxxAdapter;
 
+// Consumer end of the queue that DtlsIceTransportListenerCxxAdapter pushes events into from the
+// event loop thread. Only one thread may pop events at a time.
+struct DtlsIceTransportEventQueueFacade {
+    explicit DtlsIceTransportEventQueueFacade(std::shared_ptr<DtlsIceTransportEventQueue> queue);
+    bool pop_event(DtlsIceTransportEvent &event);
+    bool is_closed() const;
+    DtlsIceTransportEventQueueStats get_stats() const;
+
+private:
+    std::shared_ptr<DtlsIceTransportEventQueue> queue;
+};
+
 struct OwnedRtpBundleTransportConnection {
-    OwnedRtpBundleTransportConnection(std::shared_ptr<RTPBundleTransport> transport, RTPBundleTransport::Connection *connection);
+    OwnedRtpBundleTransportConnection(std::shared_ptr<RTPBundleTransport> transport, std::shared_ptr<std::atomic<size_t>> connection_count, RTPBundleTransport::Connection *connection);
     ~OwnedRtpBundleTransportConnection();
     RTPBundleTransport::Connection *operator->();
 
 private:
     std::shared_ptr<RTPBundleTransport> transport;
+    std::shared_ptr<std::atomic<size_t>> connection_count;
     RTPBundleTransport::Connection *connection;
 };
 
 struct RtpStreamTransponderFacade;
 
+class KeyframeCache;
+class KeyframeRequestAggregator;
+struct KeyframeRequestStats;
+
 struct OwnedRtpIncomingSourceGroup {
     OwnedRtpIncomingSourceGroup(std::shared_ptr<OwnedRtpBundleTransportConnection> connection, std::unique_ptr<RTPIncomingSourceGroup> source_group);
     ~OwnedRtpIncomingSourceGroup();
     RTPIncomingSourceGroup *operator->();
+    void enable_keyframe_cache(size_t max_packets);
+    std::shared_ptr<KeyframeCache> get_keyframe_cache() const;
+    KeyframeRequestAggregator &get_keyframe_requests();
 
 private:
     std::unique_ptr<RTPIncomingSourceGroup> source_group;
     std::shared_ptr<OwnedRtpBundleTransportConnection> connection;
+    std::shared_ptr<KeyframeCache> keyframe_cache;
+    std::shared_ptr<KeyframeRequestAggregator> keyframe_requests;
 
     friend struct RtpStreamTransponderFacade;
+    friend class KeyframeSwitch;
+};
+
+// Read-only reference to a received packet, sharing ownership with media-server rather than copying.
+struct RtpPacketFacade {
+    explicit RtpPacketFacade(RTPPacket::shared packet);
+    uint32_t get_ssrc() const;
+    uint16_t get_sequence_number() const;
+    uint32_t get_timestamp() const;
+    uint8_t get_payload_type() const;
+    bool get_marker() const;
+    bool is_key_frame() const;
+    rust::Slice<const uint8_t> get_payload() const;
+    std::unique_ptr<RtpPacketFacade> retain() const;
+
+private:
+    RTPPacket::shared packet;
+};
+
+struct RtpPacketListenerRustAdapter;
+struct RtpPacketListenerCxxAdapter;
+
+struct RtpPacketTapFacade {
+    RtpPacketTapFacade(std::shared_ptr<OwnedRtpIncomingSourceGroup> source_group, rust::Box<RtpPacketListenerRustAdapter> listener);
+    ~RtpPacketTapFacade();
+
+private:
+    std::shared_ptr<OwnedRtpIncomingSourceGroup> source_group;
+    std::unique_ptr<RtpPacketListenerCxxAdapter> listener;
+};
+
+class MediaFrameBufferPool;
+
+// Either a view of a frame that is only valid during a MediaFrameListener callback, or (once
+// retained) a copy of it in a buffer that is returned to the stream's pool when dropped.
+struct MediaFrameFacade {
+    MediaFrameFacade(const MediaFrame &frame, std::shared_ptr<MediaFrameBufferPool> pool);
+    MediaFrameFacade(const MediaFrameFacade &view, std::vector<uint8_t> buffer);
+    ~MediaFrameFacade();
+    MediaFrameType get_type() const;
+    uint64_t get_timestamp() const;
+    uint32_t get_clock_rate() const;
+    bool is_intra() const;
+    rust::Slice<const uint8_t> get_data() const;
+    std::unique_ptr<MediaFrameFacade> retain() const;
+
+    static void *operator new(size_t size);
+    static void operator delete(void *pointer);
+
+private:
+    MediaFrameType type;
+    uint64_t timestamp;
+    uint32_t clock_rate;
+    bool intra;
+    const uint8_t *data;
+    size_t length;
+    std::vector<uint8_t> buffer;
+    std::shared_ptr<MediaFrameBufferPool> pool;
+};
+
+struct MediaFrameListenerRustAdapter;
+struct MediaFrameListenerCxxAdapter;
+
+struct MediaFrameTapFacade {
+    MediaFrameTapFacade(std::shared_ptr<OwnedRtpIncomingSourceGroup> source_group, rust::Box<MediaFrameListenerRustAdapter> listener);
+    ~MediaFrameTapFacade();
+
+private:
+    std::shared_ptr<OwnedRtpIncomingSourceGroup> source_group;
+    std::unique_ptr<RTPIncomingMediaStreamDepacketizer> depacketizer;
+    std::unique_ptr<MediaFrameListenerCxxAdapter> listener;
 };
 
 struct RtpIncomingSourceGroupFacade {
     RtpIncomingSourceGroupFacade(std::shared_ptr<OwnedRtpIncomingSourceGroup> source_group);
+    ~RtpIncomingSourceGroupFacade();
+    std::unique_ptr<RtpPacketTapFacade> add_packet_listener(rust::Box<RtpPacketListenerRustAdapter> listener);
+    std::unique_ptr<MediaFrameTapFacade> add_media_frame_listener(rust::Box<MediaFrameListenerRustAdapter> listener);
+    void enable_keyframe_cache(size_t max_packets);
+    void set_keyframe_request_interval(uint32_t min_interval_ms);
+    KeyframeRequestStats get_keyframe_request_stats() const;
 
 private:
     std::shared_ptr<OwnedRtpIncomingSourceGroup> source_group;
@@ -85,6 +229,7 @@ private:
 
 struct RtpOutgoingSourceGroupFacade {
     RtpOutgoingSourceGroupFacade(std::shared_ptr<OwnedRtpOutgoingSourceGroup> source_group);
+    ~RtpOutgoingSourceGroupFacade();
 
     std::unique_ptr<RtpStreamTransponderFacade> add_transponder();
 
@@ -94,24 +239,53 @@ private:
     friend struct RtpStreamTransponderFacade;
 };
 
+struct RtpLayerSelection;
+struct RtpStreamTransponderSwitchStats;
+class KeyframeSwitch;
+
 struct RtpStreamTransponderFacade {
     explicit RtpStreamTransponderFacade(RtpOutgoingSourceGroupFacade &outgoing);
+    ~RtpStreamTransponderFacade();
     void set_incoming(RtpIncomingSourceGroupFacade &new_incoming);
+    void set_incoming_on_keyframe(RtpIncomingSourceGroupFacade &new_incoming);
+    RtpStreamTransponderSwitchStats get_switch_stats() const;
+    void select_layer(uint8_t spatial_layer_id, uint8_t temporal_layer_id);
+    void set_maximum_layers(uint8_t max_spatial_layer_id, uint8_t max_temporal_layer_id);
+    RtpLayerSelection get_current_layers() const;
 
 private:
-    std::shared_ptr<OwnedRtpIncomingSourceGroup> incoming;
     std::shared_ptr<OwnedRtpOutgoingSourceGroup> outgoing;
-    std::unique_ptr<RTPStreamTransponder> transponder;
+    std::shared_ptr<RTPStreamTransponder> transponder;
+    std::shared_ptr<KeyframeSwitch> keyframe_switch;
+};
+
+struct RtpIncomingSourceGroupParameters;
+struct RtpOutgoingSourceGroupParameters;
+
+// Result of RtpBundleTransportConnectionFacade::add_source_groups, each facade can be taken once.
+struct RtpSourceGroupBatchFacade {
+    RtpSourceGroupBatchFacade(std::vector<std::unique_ptr<RtpIncomingSourceGroupFacade>> incoming, std::vector<std::unique_ptr<RtpOutgoingSourceGroupFacade>> outgoing);
+    size_t get_incoming_count() const;
+    size_t get_outgoing_count() const;
+    std::unique_ptr<RtpIncomingSourceGroupFacade> take_incoming(size_t index);
+    std::unique_ptr<RtpOutgoingSourceGroupFacade> take_outgoing(size_t index);
+
+private:
+    std::vector<std::unique_ptr<RtpIncomingSourceGroupFacade>> incoming;
+    std::vector<std::unique_ptr<RtpOutgoingSourceGroupFacade>> outgoing;
 };
 
 struct RtpBundleTransportConnectionFacade {
     RtpBundleTransportConnectionFacade(std::shared_ptr<RTPBundleTransport> transport, std::shared_ptr<OwnedRtpBundleTransportConnection> connection);
     ~RtpBundleTransportConnectionFacade();
-    void set_listener(rust::Box<DtlsIceTransportListenerRustAdapter> listener);
+    std::unique_ptr<DtlsIceTransportEventQueueFacade> set_event_queue(size_t capacity, rust::Box<DtlsIceTransportEventNotifierRustAdapter> notifier);
     void set_remote_properties(const PropertiesFacade &properties);
     void set_local_properties(const PropertiesFacade &properties);
+    void set_remote_rtp_parameters(const RtpMediaParameters &audio, const RtpMediaParameters &video);
+    void set_local_rtp_parameters(const RtpMediaParameters &audio, const RtpMediaParameters &video);
     std::unique_ptr<RtpIncomingSourceGroupFacade> add_incoming_source_group(MediaFrameType type, rust::Str mid, rust::Str rid, uint32_t mediaSsrc, uint32_t rtxSsrc);
     std::unique_ptr<RtpOutgoingSourceGroupFacade> add_outgoing_source_group(MediaFrameType type, rust::Str mid, uint32_t mediaSsrc, uint32_t rtxSsrc);
+    std::unique_ptr<RtpSourceGroupBatchFacade> add_source_groups(rust::Slice<const RtpIncomingSourceGroupParameters> incoming, rust::Slice<const RtpOutgoingSourceGroupParameters> outgoing);
     void add_remote_candidate(rust::Str ip, uint16_t port);
 
 private:
@@ -122,11 +296,38 @@ private:
 
 struct RtpBundleTransportFacade {
     RtpBundleTransportFacade(uint16_t port = 0);
+    ~RtpBundleTransportFacade();
     uint16_t get_local_port() const;
+    size_t get_connection_count() const;
+    bool set_affinity(int cpu);
     std::unique_ptr<RtpBundleTransportConnectionFacade> add_ice_transport(rust::Str username, const PropertiesFacade &properties);
+    std::unique_ptr<RtpBundleTransportConnectionFacade> add_ice_transport_with_parameters(rust::Str username, const IceTransportParameters &parameters);
+    std::unique_ptr<RtpBundleTransportConnectionFacade> add_ice_transport_with_properties(rust::Str username, const Properties &properties);
 
 private:
     std::shared_ptr<RTPBundleTransport> transport;
+    std::shared_ptr<std::atomic<size_t>> connection_count;
 };
 
 std::unique_ptr<RtpBundleTransportFacade> new_rtp_bundle_transport(uint16_t port = 0);
+
+struct RtpBundleTransportShardStats;
+
+// Owns one RTPBundleTransport (and so one event loop thread) per shard, pinned to a core each.
+// Connections are assigned to a shard by a hash of their ICE username, so callers must advertise
+// the local port of that shard as the candidate for the connection.
+struct RtpBundleTransportPoolFacade {
+    explicit RtpBundleTransportPoolFacade(size_t shard_count = 0);
+    size_t get_shard_count() const;
+    size_t get_shard_for_username(rust::Str username) const;
+    uint16_t get_shard_local_port(size_t shard) const;
+    rust::Vec<RtpBundleTransportShardStats> get_shard_stats() const;
+    std::unique_ptr<RtpBundleTransportConnectionFacade> add_ice_transport(rust::Str username, const PropertiesFacade &properties) const;
+    std::unique_ptr<RtpBundleTransportConnectionFacade> add_ice_transport_with_parameters(rust::Str username, const IceTransportParameters &parameters) const;
+
+private:
+    std::vector<std::unique_ptr<RtpBundleTransportFacade>> shards;
+    std::unique_ptr<std::mutex[]> shard_mutexes;
+};
+
+std::unique_ptr<RtpBundleTransportPoolFacade> new_rtp_bundle_transport_pool(size_t shard_count = 0);
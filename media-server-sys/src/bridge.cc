@@ -3,6 +3,33 @@
 
 #include "OpenSSL.h"
 #include "RTPTransport.h"
+#include "srtp.h"
+#include "video.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 
 // This is from media-server, but it doesn't have an implementation.
 // It should not actually ever be called.
@@ -10,152 +37,1757 @@ void EvenSource::SendEvent(const char *type, const char *msg, ...) {
     Debug("-EvenSource::SendEvent(%s, %s, ...)", type, msg);
 }
 
-void logger_enable_log(bool flag) {
-    Logger::EnableLog(flag);
-}
+void logger_enable_log(bool flag) {
+    Logger::EnableLog(flag);
+}
+
+void logger_enable_debug(bool flag) {
+    Logger::EnableDebug(flag);
+}
+
+void logger_enable_ultra_debug(bool flag) {
+    Logger::EnableUltraDebug(flag);
+}
+
+void openssl_class_init() {
+    if (!OpenSSL::ClassInit()) {
+        throw std::runtime_error("openssl initialization failed");
+    }
+}
+
+static bool has_configured_certificate = false;
+
+void dtls_connection_set_certificate(rust::Str cert_path, rust::Str key_path) {
+    // DTLSConnection keeps its own copies of the paths.
+    DTLSConnection::SetCertificate(std::string(cert_path).c_str(), std::string(key_path).c_str());
+    has_configured_certificate = true;
+}
+
+struct OpenSslDeleter {
+    void operator()(EVP_PKEY *key) const { EVP_PKEY_free(key); }
+    void operator()(EVP_PKEY_CTX *context) const { EVP_PKEY_CTX_free(context); }
+    void operator()(X509 *certificate) const { X509_free(certificate); }
+    void operator()(SSL_CTX *context) const { SSL_CTX_free(context); }
+    void operator()(SSL *ssl) const { SSL_free(ssl); }
+    void operator()(FILE *file) const { fclose(file); }
+};
+
+template <typename T>
+using OpenSslPtr = std::unique_ptr<T, OpenSslDeleter>;
+
+static OpenSslPtr<EVP_PKEY> generate_certificate_key(DtlsCertificateKeyType key_type) {
+    // ECDSA signatures are far cheaper than RSA ones for the server side of the handshake.
+    auto id = key_type == DtlsCertificateKeyType::EcdsaP256 ? EVP_PKEY_EC : EVP_PKEY_RSA;
+
+    OpenSslPtr<EVP_PKEY_CTX> context(EVP_PKEY_CTX_new_id(id, nullptr));
+    if (!context || EVP_PKEY_keygen_init(context.get()) <= 0) {
+        throw std::runtime_error("failed to set up certificate key generation");
+    }
+
+    auto configured = key_type == DtlsCertificateKeyType::EcdsaP256
+        ? EVP_PKEY_CTX_set_ec_paramgen_curve_nid(context.get(), NID_X9_62_prime256v1) > 0 && EVP_PKEY_CTX_set_ec_param_enc(context.get(), OPENSSL_EC_NAMED_CURVE) > 0
+        : EVP_PKEY_CTX_set_rsa_keygen_bits(context.get(), 2048) > 0;
+    if (!configured) {
+        throw std::runtime_error("failed to set up certificate key generation");
+    }
+
+    EVP_PKEY *key = nullptr;
+    if (EVP_PKEY_keygen(context.get(), &key) <= 0) {
+        throw std::runtime_error("failed to generate certificate key");
+    }
+
+    return OpenSslPtr<EVP_PKEY>(key);
+}
+
+static OpenSslPtr<X509> generate_certificate(EVP_PKEY *key) {
+    OpenSslPtr<X509> certificate(X509_new());
+    if (!certificate) {
+        throw std::runtime_error("failed to allocate certificate");
+    }
+
+    uint32_t serial = 0;
+    RAND_bytes(reinterpret_cast<unsigned char *>(&serial), sizeof(serial));
+
+    // WebRTC only checks the fingerprint, so the subject and validity just need to be sane.
+    X509_set_version(certificate.get(), 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate.get()), serial & 0x7FFFFFFF);
+    X509_gmtime_adj(X509_get_notBefore(certificate.get()), -24 * 60 * 60);
+    X509_gmtime_adj(X509_get_notAfter(certificate.get()), 10L * 365 * 24 * 60 * 60);
+    X509_set_pubkey(certificate.get(), key);
+
+    auto name = X509_get_subject_name(certificate.get());
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>("media-server-rs"), -1, -1, 0);
+    X509_set_issuer_name(certificate.get(), name);
+
+    if (X509_sign(certificate.get(), key, EVP_sha256()) == 0) {
+        throw std::runtime_error("failed to sign certificate");
+    }
+
+    return certificate;
+}
+
+// Best effort, not every filesystem lets a directory be synced.
+static void sync_directory(const std::string &path) {
+    auto separator = path.rfind('/');
+    auto directory = separator == std::string::npos ? std::string(".") : path.substr(0, std::max<size_t>(separator, 1));
+
+    auto fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// Writes to a temporary file next to the destination and renames it into place, so that readers
+// only ever see a complete file.
+static void write_pem_file(const std::string &path, mode_t mode, const std::function<bool(FILE *)> &write) {
+    auto temp_path = path + ".XXXXXX";
+    auto fd = mkstemp(&temp_path[0]);
+    if (fd < 0) {
+        throw std::runtime_error("failed to create a temporary file for " + path);
+    }
+
+    OpenSslPtr<FILE> file;
+    if (fchmod(fd, mode) == 0) {
+        file.reset(fdopen(fd, "w"));
+    }
+
+    if (!file) {
+        close(fd);
+        unlink(temp_path.c_str());
+        throw std::runtime_error("failed to open " + temp_path + " for writing");
+    }
+
+    auto written = write(file.get()) && fflush(file.get()) == 0 && fsync(fileno(file.get())) == 0;
+    auto closed = fclose(file.release()) == 0;
+
+    if (!written || !closed || rename(temp_path.c_str(), path.c_str()) != 0) {
+        unlink(temp_path.c_str());
+        throw std::runtime_error("failed to write " + path);
+    }
+
+    sync_directory(path);
+}
+
+static void write_certificate_files(const std::string &cert_path, const std::string &key_path, DtlsCertificateKeyType key_type) {
+    auto key = generate_certificate_key(key_type);
+    auto certificate = generate_certificate(key.get());
+
+    // The certificate is written last and marks the pair as complete, so a crash in between never
+    // leaves a new key next to an old certificate.
+    if (unlink(cert_path.c_str()) == 0) {
+        sync_directory(cert_path);
+    }
+
+    write_pem_file(key_path, 0600, [&](FILE *file) {
+        return PEM_write_PrivateKey(file, key.get(), nullptr, nullptr, 0, nullptr, nullptr) != 0;
+    });
+
+    write_pem_file(cert_path, 0644, [&](FILE *file) {
+        return PEM_write_X509(file, certificate.get()) != 0;
+    });
+}
+
+// Held while checking for and generating a certificate pair, so that servers starting together on
+// shared storage don't each write their own. Creating a file with O_EXCL is atomic on local
+// filesystems and NFSv3 onwards.
+class CertificateLockFile {
+public:
+    explicit CertificateLockFile(std::string path):
+        path(std::move(path)) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+
+        for (;;) {
+            auto fd = open(this->path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+            if (fd >= 0) {
+                close(fd);
+                return;
+            }
+
+            if (errno != EEXIST) {
+                throw std::runtime_error("failed to create " + this->path);
+            }
+
+            if (std::chrono::steady_clock::now() >= deadline) {
+                throw std::runtime_error(this->path + " is held by another process, remove it if it is stale");
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+    ~CertificateLockFile() {
+        unlink(path.c_str());
+    }
+
+private:
+    std::string path;
+};
+
+void dtls_connection_ensure_certificate(rust::Str cert_path, rust::Str key_path, DtlsCertificateKeyType key_type) {
+    auto cert_path_string = std::string(cert_path);
+    auto key_path_string = std::string(key_path);
+
+    CertificateLockFile lock(cert_path_string + ".lock");
+
+    if (access(cert_path_string.c_str(), F_OK) == 0 && access(key_path_string.c_str(), F_OK) == 0) {
+        return;
+    }
+
+    write_certificate_files(cert_path_string, key_path_string, key_type);
+}
+
+class FileDescriptor {
+public:
+    explicit FileDescriptor(int fd):
+        fd(fd) {}
+
+    FileDescriptor(const FileDescriptor &) = delete;
+    FileDescriptor &operator=(const FileDescriptor &) = delete;
+
+    ~FileDescriptor() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    int get() const {
+        return fd;
+    }
+
+private:
+    int fd;
+};
+
+static void write_pem_descriptor(int fd, const std::function<bool(FILE *)> &write) {
+    // Written through a copy, the descriptor itself has to stay open for DTLSConnection to read.
+    auto copy = dup(fd);
+    OpenSslPtr<FILE> file(copy >= 0 ? fdopen(copy, "w") : nullptr);
+    if (!file) {
+        if (copy >= 0) {
+            close(copy);
+        }
+
+        throw std::runtime_error("failed to open in-memory certificate file");
+    }
+
+    if (!write(file.get()) || fflush(file.get()) != 0) {
+        throw std::runtime_error("failed to write in-memory certificate file");
+    }
+}
+
+// Returns false if anonymous memory files aren't available, so the caller can fall back to a
+// temporary directory.
+static bool initialize_with_memory_files(DtlsCertificateKeyType key_type, int &result) {
+    FileDescriptor key_fd(memfd_create("media-server-dtls-key", MFD_CLOEXEC));
+    FileDescriptor cert_fd(memfd_create("media-server-dtls-cert", MFD_CLOEXEC));
+    if (key_fd.get() < 0 || cert_fd.get() < 0) {
+        return false;
+    }
+
+    auto key = generate_certificate_key(key_type);
+    auto certificate = generate_certificate(key.get());
+
+    write_pem_descriptor(key_fd.get(), [&](FILE *file) {
+        return PEM_write_PrivateKey(file, key.get(), nullptr, nullptr, 0, nullptr, nullptr) != 0;
+    });
+
+    write_pem_descriptor(cert_fd.get(), [&](FILE *file) {
+        return PEM_write_X509(file, certificate.get()) != 0;
+    });
+
+    auto cert_path = "/proc/self/fd/" + std::to_string(cert_fd.get());
+    auto key_path = "/proc/self/fd/" + std::to_string(key_fd.get());
+
+    DTLSConnection::SetCertificate(cert_path.c_str(), key_path.c_str());
+    result = DTLSConnection::Initialize();
+
+    return true;
+}
+
+static int initialize_with_temporary_files(DtlsCertificateKeyType key_type) {
+    auto temp_directory = getenv("TMPDIR");
+    auto directory = std::string(temp_directory && *temp_directory ? temp_directory : "/tmp") + "/media-server-dtls-XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        throw std::runtime_error("failed to create temporary certificate directory");
+    }
+
+    auto cert_path = directory + "/cert.pem";
+    auto key_path = directory + "/key.pem";
+
+    auto remove_files = [&] {
+        unlink(cert_path.c_str());
+        unlink(key_path.c_str());
+        rmdir(directory.c_str());
+    };
+
+    int result = 0;
+    try {
+        write_certificate_files(cert_path, key_path, key_type);
+        DTLSConnection::SetCertificate(cert_path.c_str(), key_path.c_str());
+        result = DTLSConnection::Initialize();
+    } catch (...) {
+        remove_files();
+        throw;
+    }
+
+    remove_files();
+
+    return result;
+}
+
+void dtls_connection_initialize(DtlsCertificateKeyType key_type) {
+    if (has_configured_certificate) {
+        if (DTLSConnection::Initialize() == 0) {
+            throw std::runtime_error("dtls initialization failed");
+        }
+
+        return;
+    }
+
+    // DTLSConnection can only load a certificate from files. A generated one is handed over through
+    // anonymous memory files where possible, so the private key never touches a disk.
+    int result = 0;
+    if (!initialize_with_memory_files(key_type, result)) {
+        result = initialize_with_temporary_files(key_type);
+    }
+
+    if (result == 0) {
+        throw std::runtime_error("dtls initialization failed");
+    }
+}
+
+static bool continue_handshake(SSL *ssl) {
+    auto result = SSL_do_handshake(ssl);
+    if (result == 1) {
+        return true;
+    }
+
+    auto error = SSL_get_error(ssl, result);
+    if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+        throw std::runtime_error("benchmark handshake failed");
+    }
+
+    return false;
+}
+
+uint64_t dtls_certificate_handshake_benchmark(DtlsCertificateKeyType key_type, size_t handshakes) {
+    auto key = generate_certificate_key(key_type);
+    auto certificate = generate_certificate(key.get());
+
+    // TLS 1.2 over a BIO pair does the same key exchange and signatures as a DTLS 1.2 handshake,
+    // without retransmission timers getting in the way of an in-memory loop.
+    OpenSslPtr<SSL_CTX> server_context(SSL_CTX_new(TLS_server_method()));
+    OpenSslPtr<SSL_CTX> client_context(SSL_CTX_new(TLS_client_method()));
+    if (!server_context || !client_context) {
+        throw std::runtime_error("failed to create benchmark ssl contexts");
+    }
+
+    SSL_CTX_use_certificate(server_context.get(), certificate.get());
+    SSL_CTX_use_PrivateKey(server_context.get(), key.get());
+
+    for (auto context : {server_context.get(), client_context.get()}) {
+        SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+        SSL_CTX_set_max_proto_version(context, TLS1_2_VERSION);
+        SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+        SSL_CTX_set_verify(context, SSL_VERIFY_NONE, nullptr);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < handshakes; ++i) {
+        OpenSslPtr<SSL> server(SSL_new(server_context.get()));
+        OpenSslPtr<SSL> client(SSL_new(client_context.get()));
+
+        BIO *server_bio = nullptr;
+        BIO *client_bio = nullptr;
+        if (!server || !client || BIO_new_bio_pair(&server_bio, 0, &client_bio, 0) == 0) {
+            throw std::runtime_error("failed to create benchmark connection");
+        }
+
+        SSL_set_bio(server.get(), server_bio, server_bio);
+        SSL_set_bio(client.get(), client_bio, client_bio);
+        SSL_set_accept_state(server.get());
+        SSL_set_connect_state(client.get());
+
+        bool client_done = false;
+        bool server_done = false;
+        for (int flight = 0; flight < 16 && !(client_done && server_done); ++flight) {
+            client_done = continue_handshake(client.get());
+            server_done = continue_handshake(server.get());
+        }
+
+        if (!client_done || !server_done) {
+            throw std::runtime_error("benchmark handshake did not complete");
+        }
+    }
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+rust::String dtls_connection_get_certificate_fingerprint(DtlsConnectionHash hash) {
+    auto fingerprint = DTLSConnection::GetCertificateFingerPrint(hash);
+    if (fingerprint.empty()) {
+        throw std::runtime_error("no certificate fingerprint for hash - dtls not initialized?");
+    }
+
+    return fingerprint;
+}
+
+void rtp_transport_set_port_range(uint16_t min, uint16_t max) {
+    if (!RTPTransport::SetPortRange(min, max)) {
+        throw std::runtime_error("failed to set rtp port range");
+    }
+}
+
+static const char *srtp_protection_profile_name(SrtpProtectionProfile profile) {
+    switch (profile) {
+        case SrtpProtectionProfile::AeadAes128Gcm:
+            return "SRTP_AEAD_AES_128_GCM";
+        case SrtpProtectionProfile::AeadAes256Gcm:
+            return "SRTP_AEAD_AES_256_GCM";
+        case SrtpProtectionProfile::Aes128CmSha1_80:
+            return "SRTP_AES128_CM_SHA1_80";
+        case SrtpProtectionProfile::Aes128CmSha1_32:
+            return "SRTP_AES128_CM_SHA1_32";
+    }
+
+    throw std::runtime_error("unknown srtp protection profile");
+}
+
+// Formats the profiles for DTLSConnection (and from there SSL_set_tlsext_use_srtp), in order of
+// preference. With none given we prefer AES-GCM, which OpenSSL runs on AES-NI, and fall back to
+// the AES-CM / HMAC-SHA1 profile every browser supports.
+static std::string format_srtp_protection_profiles(rust::Slice<const SrtpProtectionProfile> profiles) {
+    static const SrtpProtectionProfile default_profiles[] = {
+        SrtpProtectionProfile::AeadAes128Gcm,
+        SrtpProtectionProfile::Aes128CmSha1_80,
+    };
+
+    if (profiles.empty()) {
+        profiles = rust::Slice<const SrtpProtectionProfile>(default_profiles, std::size(default_profiles));
+    }
+
+    std::string formatted;
+    for (auto profile : profiles) {
+        if (!formatted.empty()) {
+            formatted += ':';
+        }
+
+        formatted += srtp_protection_profile_name(profile);
+    }
+
+    return formatted;
+}
+
+static void set_srtp_crypto_policy(srtp_policy_t &policy, SrtpProtectionProfile profile) {
+    switch (profile) {
+        case SrtpProtectionProfile::AeadAes128Gcm:
+            srtp_crypto_policy_set_aes_gcm_128_16_auth(&policy.rtp);
+            srtp_crypto_policy_set_aes_gcm_128_16_auth(&policy.rtcp);
+            return;
+        case SrtpProtectionProfile::AeadAes256Gcm:
+            srtp_crypto_policy_set_aes_gcm_256_16_auth(&policy.rtp);
+            srtp_crypto_policy_set_aes_gcm_256_16_auth(&policy.rtcp);
+            return;
+        case SrtpProtectionProfile::Aes128CmSha1_80:
+            srtp_crypto_policy_set_aes_cm_128_hmac_sha1_80(&policy.rtp);
+            srtp_crypto_policy_set_aes_cm_128_hmac_sha1_80(&policy.rtcp);
+            return;
+        case SrtpProtectionProfile::Aes128CmSha1_32:
+            srtp_crypto_policy_set_aes_cm_128_hmac_sha1_32(&policy.rtp);
+            srtp_crypto_policy_set_aes_cm_128_hmac_sha1_80(&policy.rtcp);
+            return;
+    }
+
+    throw std::runtime_error("unknown srtp protection profile");
+}
+
+struct SrtpSessionDeleter {
+    void operator()(srtp_t session) const { srtp_dealloc(session); }
+};
+
+using SrtpSessionPtr = std::unique_ptr<std::remove_pointer_t<srtp_t>, SrtpSessionDeleter>;
+
+static SrtpSessionPtr make_srtp_session(SrtpProtectionProfile profile, srtp_ssrc_type_t direction, unsigned char *key) {
+    srtp_policy_t policy = {};
+    set_srtp_crypto_policy(policy, profile);
+    policy.ssrc.type = direction;
+    policy.key = key;
+    policy.window_size = 1024;
+
+    srtp_t session = nullptr;
+    if (srtp_create(&session, &policy) != srtp_err_status_ok) {
+        throw std::runtime_error("failed to create srtp session - profile not compiled in?");
+    }
+
+    return SrtpSessionPtr(session);
+}
+
+SrtpBenchmarkResult srtp_benchmark(SrtpProtectionProfile profile, size_t payload_size, size_t packets) {
+    static constexpr size_t header_size = 12;
+    static constexpr size_t batch_size = 256;
+
+    if (srtp_init() != srtp_err_status_ok) {
+        throw std::runtime_error("srtp initialization failed");
+    }
+
+    unsigned char key[SRTP_MAX_KEY_LEN] = {};
+    for (size_t i = 0; i < sizeof(key); ++i) {
+        key[i] = static_cast<unsigned char>(i * 7 + 1);
+    }
+
+    auto protect_session = make_srtp_session(profile, ssrc_any_outbound, key);
+    auto unprotect_session = make_srtp_session(profile, ssrc_any_inbound, key);
+
+    std::vector<std::vector<uint8_t>> batch(batch_size, std::vector<uint8_t>(header_size + payload_size + SRTP_MAX_TRAILER_LEN));
+    std::vector<int> lengths(batch_size);
+
+    std::chrono::nanoseconds protect_time {0};
+    std::chrono::nanoseconds unprotect_time {0};
+    bool failed = false;
+
+    // Timed a batch at a time so the clock reads don't dominate small packets.
+    for (size_t sent = 0; sent < packets && !failed; sent += batch_size) {
+        auto count = std::min(batch_size, packets - sent);
+
+        for (size_t i = 0; i < count; ++i) {
+            auto &packet = batch[i];
+            auto sequence = static_cast<uint16_t>(sent + i);
+            std::fill(packet.begin(), packet.end(), 0xAB);
+            packet[0] = 0x80;
+            packet[1] = 96;
+            packet[2] = sequence >> 8;
+            packet[3] = sequence & 0xFF;
+            std::fill(packet.begin() + 4, packet.begin() + header_size, 0x11);
+            lengths[i] = static_cast<int>(header_size + payload_size);
+        }
+
+        auto protect_start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < count; ++i) {
+            failed |= srtp_protect(protect_session.get(), batch[i].data(), &lengths[i]) != srtp_err_status_ok;
+        }
+
+        auto unprotect_start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < count; ++i) {
+            failed |= srtp_unprotect(unprotect_session.get(), batch[i].data(), &lengths[i]) != srtp_err_status_ok;
+        }
+
+        auto end = std::chrono::steady_clock::now();
+        protect_time += unprotect_start - protect_start;
+        unprotect_time += end - unprotect_start;
+    }
+
+    if (failed) {
+        throw std::runtime_error("srtp protect / unprotect failed");
+    }
+
+    return SrtpBenchmarkResult{
+        static_cast<uint64_t>(protect_time.count()),
+        static_cast<uint64_t>(unprotect_time.count()),
+    };
+}
+
+// Single background thread that runs the (blocking) destructors of media-server objects, in the
+// order they were released. Intentionally leaked so it outlives any static destructors.
+class TeardownQueue {
+public:
+    static TeardownQueue &instance() {
+        static auto *queue = new TeardownQueue();
+        return *queue;
+    }
+
+    void push(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+
+        condition.notify_one();
+    }
+
+private:
+    TeardownQueue(): thread([this] { run(); }) {
+        thread.detach();
+    }
+
+    void run() {
+        for (;;) {
+            std::function<void()> task;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this] { return !tasks.empty(); });
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+
+            task();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::function<void()>> tasks;
+    std::thread thread;
+};
+
+template <typename T>
+static void release_on_teardown_thread(std::shared_ptr<T> &&object) {
+    TeardownQueue::instance().push([object = std::move(object)]() mutable {
+        object.reset();
+    });
+}
+
+void teardown_flush(rust::Box<TeardownCompletionRustAdapter> completion) {
+    auto shared_completion = std::make_shared<rust::Box<TeardownCompletionRustAdapter>>(std::move(completion));
+    TeardownQueue::instance().push([shared_completion] {
+        (*shared_completion)->complete();
+    });
+}
+
+PropertiesFacade::PropertiesFacade(Properties properties):
+    properties(std::move(properties)) {}
+
+PropertiesFacade::operator const Properties &() const {
+    return properties;
+}
+
+void PropertiesFacade::set_int(rust::Str key, int value) {
+    std::string key_string = std::string(key);
+    properties.SetProperty(key_string.c_str(), value);
+}
+
+void PropertiesFacade::set_bool(rust::Str key, bool value) {
+    std::string key_string = std::string(key);
+    properties.SetProperty(key_string.c_str(), value);
+}
+
+void PropertiesFacade::set_string(rust::Str key, rust::Str value) {
+    std::string key_string = std::string(key);
+    std::string value_string = std::string(value);
+    properties.SetProperty(key_string.c_str(), value_string.c_str());
+}
+
+static std::string get_property_key(const Properties &properties, rust::Str key) {
+    std::string key_string = std::string(key);
+    if (!properties.HasProperty(key_string)) {
+        throw std::runtime_error("missing property " + key_string);
+    }
+
+    return key_string;
+}
+
+int PropertiesFacade::get_int(rust::Str key) const {
+    auto key_string = get_property_key(properties, key);
+    return properties.GetProperty(key_string.c_str(), 0);
+}
+
+bool PropertiesFacade::get_bool(rust::Str key) const {
+    auto key_string = get_property_key(properties, key);
+    return properties.GetProperty(key_string.c_str(), false);
+}
+
+rust::String PropertiesFacade::get_string(rust::Str key) const {
+    auto key_string = get_property_key(properties, key);
+    return rust::String(properties.GetProperty(key_string.c_str(), ""));
+}
+
+std::unique_ptr<PropertiesFacade> new_properties() {
+    return std::make_unique<PropertiesFacade>();
+}
+
+// The typed parameters are translated into the Properties that media-server expects here, in one
+// go, so that callers don't need to build up (and copy) a string key for every single value.
+
+static void set_string_property(Properties &properties, const char *key, rust::Str value) {
+    properties.SetProperty(key, std::string(value).c_str());
+}
+
+static Properties make_ice_transport_properties(const IceTransportParameters &parameters) {
+    Properties properties;
+
+    set_string_property(properties, "ice.localUsername", parameters.local_username);
+    set_string_property(properties, "ice.localPassword", parameters.local_password);
+    set_string_property(properties, "ice.remoteUsername", parameters.remote_username);
+    set_string_property(properties, "ice.remotePassword", parameters.remote_password);
+    set_string_property(properties, "dtls.setup", parameters.dtls_setup);
+    set_string_property(properties, "dtls.hash", parameters.dtls_hash);
+    set_string_property(properties, "dtls.fingerprint", parameters.dtls_fingerprint);
+    properties.SetProperty("disableSTUNKeepAlive", parameters.disable_stun_keep_alive);
+    properties.SetProperty("srtpProtectionProfiles", format_srtp_protection_profiles(parameters.srtp_protection_profiles).c_str());
+
+    return properties;
+}
+
+static void add_rtp_media_properties(Properties &properties, const char *kind, const RtpMediaParameters &media) {
+    char key[64];
+
+    size_t i = 0;
+    for (const auto &codec : media.codecs) {
+        snprintf(key, sizeof(key), "%s.codecs.%zu.codec", kind, i);
+        set_string_property(properties, key, codec.name);
+
+        snprintf(key, sizeof(key), "%s.codecs.%zu.pt", kind, i);
+        properties.SetProperty(key, (int)codec.payload_type);
+
+        if (codec.rtx_payload_type != 0) {
+            snprintf(key, sizeof(key), "%s.codecs.%zu.rtx", kind, i);
+            properties.SetProperty(key, (int)codec.rtx_payload_type);
+        }
+
+        ++i;
+    }
+
+    snprintf(key, sizeof(key), "%s.codecs.length", kind);
+    properties.SetProperty(key, (int)media.codecs.size());
+
+    i = 0;
+    for (const auto &extension : media.extensions) {
+        snprintf(key, sizeof(key), "%s.ext.%zu.id", kind, i);
+        properties.SetProperty(key, (int)extension.id);
+
+        snprintf(key, sizeof(key), "%s.ext.%zu.uri", kind, i);
+        set_string_property(properties, key, extension.uri);
+
+        ++i;
+    }
+
+    snprintf(key, sizeof(key), "%s.ext.length", kind);
+    properties.SetProperty(key, (int)media.extensions.size());
+}
+
+static Properties make_rtp_properties(const RtpMediaParameters &audio, const RtpMediaParameters &video) {
+    Properties properties;
+
+    add_rtp_media_properties(properties, "audio", audio);
+    add_rtp_media_properties(properties, "video", video);
+
+    return properties;
+}
+
+// The same translation as a PropertiesFacade, so callers can inspect it or add keys the typed
+// parameters don't cover before handing it to add_ice_transport / set_*_properties.
+std::unique_ptr<PropertiesFacade> new_ice_transport_properties(const IceTransportParameters &parameters) {
+    return std::make_unique<PropertiesFacade>(make_ice_transport_properties(parameters));
+}
+
+std::unique_ptr<PropertiesFacade> new_rtp_properties(const RtpMediaParameters &audio, const RtpMediaParameters &video) {
+    return std::make_unique<PropertiesFacade>(make_rtp_properties(audio, video));
+}
+
+// Bounded lock-free queue based on Dmitry Vyukov's MPMC design. Any thread can push, but it is
+// only ever drained by the DtlsIceTransportEventQueueFacade owner.
+struct DtlsIceTransportEventQueue {
+    struct Event {
+        DtlsIceTransportEventKind kind;
+        DtlsIceTransportDtlsState dtls_state;
+        char ip[INET6_ADDRSTRLEN];
+        uint16_t port;
+        uint32_t priority;
+    };
+
+    explicit DtlsIceTransportEventQueue(size_t min_capacity):
+        capacity(round_up_capacity(min_capacity)), cells(new Cell[capacity]) {
+        for (size_t i = 0; i < capacity; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(const Event &event) {
+        auto position = enqueue_position.load(std::memory_order_relaxed);
+
+        for (;;) {
+            auto &cell = cells[position & (capacity - 1)];
+            auto sequence = cell.sequence.load(std::memory_order_acquire);
+            auto difference = (intptr_t)sequence - (intptr_t)position;
+
+            if (difference == 0) {
+                if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.event = event;
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                position = enqueue_position.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(Event &event) {
+        auto position = dequeue_position.load(std::memory_order_relaxed);
+        auto &cell = cells[position & (capacity - 1)];
+        auto sequence = cell.sequence.load(std::memory_order_acquire);
+
+        if ((intptr_t)sequence - (intptr_t)(position + 1) < 0) {
+            return false;
+        }
+
+        event = cell.event;
+        cell.sequence.store(position + capacity, std::memory_order_release);
+        dequeue_position.store(position + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    size_t depth() const {
+        auto dequeued = dequeue_position.load(std::memory_order_acquire);
+        auto enqueued = enqueue_position.load(std::memory_order_acquire);
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+    const size_t capacity;
+    std::atomic<uint64_t> dropped {0};
+    // Set once the listener feeding the queue is gone, nothing is pushed after that.
+    std::atomic<bool> closed {false};
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        Event event;
+    };
+
+    static size_t round_up_capacity(size_t min_capacity) {
+        size_t capacity = 2;
+        while (capacity < min_capacity) {
+            capacity <<= 1;
+        }
+
+        return capacity;
+    }
+
+    std::unique_ptr<Cell[]> cells;
+    alignas(64) std::atomic<size_t> enqueue_position {0};
+    alignas(64) std::atomic<size_t> dequeue_position {0};
+};
+
+DtlsIceTransportEventQueueFacade::DtlsIceTransportEventQueueFacade(std::shared_ptr<DtlsIceTransportEventQueue> queue):
+    queue(std::move(queue)) {}
+
+bool DtlsIceTransportEventQueueFacade::pop_event(DtlsIceTransportEvent &event) {
+    DtlsIceTransportEventQueue::Event queued;
+    if (!queue->pop(queued)) {
+        return false;
+    }
+
+    event.kind = queued.kind;
+    event.dtls_state = queued.dtls_state;
+    event.ip = rust::String(queued.ip);
+    event.port = queued.port;
+    event.priority = queued.priority;
+
+    return true;
+}
+
+bool DtlsIceTransportEventQueueFacade::is_closed() const {
+    return queue->closed.load(std::memory_order_acquire);
+}
+
+DtlsIceTransportEventQueueStats DtlsIceTransportEventQueueFacade::get_stats() const {
+    return DtlsIceTransportEventQueueStats {
+        queue->capacity,
+        queue->depth(),
+        queue->dropped.load(std::memory_order_relaxed),
+    };
+}
+
+// Runs on the event loop thread, so this must never call into Rust code that could block.
+// Events are copied into the queue and the Rust side is only told that there is something to read.
+struct DtlsIceTransportListenerCxxAdapter: DTLSICETransport::Listener {
+    DtlsIceTransportListenerCxxAdapter(std::shared_ptr<DtlsIceTransportEventQueue> queue, rust::Box<DtlsIceTransportEventNotifierRustAdapter> notifier):
+        queue(std::move(queue)), notifier(std::move(notifier)) {};
+
+    // Only freed once the loop can no longer call in, wake the reader one last time so it sees the
+    // end of the stream.
+    ~DtlsIceTransportListenerCxxAdapter() {
+        queue->closed.store(true, std::memory_order_release);
+        notifier->notify();
+    }
+
+    void onICETimeout() override {
+        DtlsIceTransportEventQueue::Event event = {};
+        event.kind = DtlsIceTransportEventKind::IceTimeout;
+        push(event);
+    }
+
+    void onDTLSStateChanged(const DtlsIceTransportDtlsState state) override {
+        DtlsIceTransportEventQueue::Event event = {};
+        event.kind = DtlsIceTransportEventKind::DtlsStateChanged;
+        event.dtls_state = state;
+        push(event);
+    }
+
+    void onRemoteICECandidateActivated(const std::string &ip, uint16_t port, uint32_t priority) override {
+        DtlsIceTransportEventQueue::Event event = {};
+        event.kind = DtlsIceTransportEventKind::RemoteIceCandidateActivated;
+        snprintf(event.ip, sizeof(event.ip), "%s", ip.c_str());
+        event.port = port;
+        event.priority = priority;
+        push(event);
+    }
+
+    void push(const DtlsIceTransportEventQueue::Event &event) {
+        if (queue->push(event)) {
+            notifier->notify();
+        }
+    }
+
+    std::shared_ptr<DtlsIceTransportEventQueue> queue;
+    rust::Box<DtlsIceTransportEventNotifierRustAdapter> notifier;
+};
+
+OwnedRtpBundleTransportConnection::OwnedRtpBundleTransportConnection(std::shared_ptr<RTPBundleTransport> transport, std::shared_ptr<std::atomic<size_t>> connection_count, RTPBundleTransport::Connection *connection):
+    transport(std::move(transport)), connection_count(std::move(connection_count)), connection(connection) {
+    ++(*this->connection_count);
+}
+
+OwnedRtpBundleTransportConnection::~OwnedRtpBundleTransportConnection() {
+    transport->RemoveICETransport(connection->username);
+    --(*connection_count);
+}
+
+RTPBundleTransport::Connection *OwnedRtpBundleTransportConnection::operator->() {
+    return connection;
+}
+
+// Keeps the packets of a source's most recent keyframe and the delta frames since, so a transponder
+// attached later can start decoding straight away instead of waiting on a PLI round trip.
+class KeyframeCache: public RTPIncomingMediaStream::Listener {
+public:
+    explicit KeyframeCache(size_t max_packets):
+        max_packets(max_packets) {}
+
+    std::vector<RTPPacket::shared> snapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        return packets;
+    }
+
+    void onRTP(RTPIncomingMediaStream *stream, const RTPPacket::shared &packet) override {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // A keyframe usually spans several packets, only start over on a new one.
+        if (packet->IsKeyFrame() && (packets.empty() || packets.front()->GetTimestamp() != packet->GetTimestamp())) {
+            packets.clear();
+        } else if (packets.empty()) {
+            return;
+        }
+
+        // Too long since the last keyframe to be worth replaying, wait for the next one.
+        if (packets.size() >= max_packets) {
+            packets.clear();
+            return;
+        }
+
+        packets.push_back(packet);
+    }
+
+    void onBye(RTPIncomingMediaStream *stream) override {}
+
+    void onEnded(RTPIncomingMediaStream *stream) override {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        packets.clear();
+    }
+
+private:
+    std::mutex mutex;
+    size_t max_packets;
+    std::vector<RTPPacket::shared> packets;
+};
+
+// Sits between a source group's transponders and its transport, so that keyframe requests from
+// many subscribers turn into at most one upstream PLI per interval. Requests inside the interval are
+// merged into a single trailing PLI once it is over.
+class KeyframeRequestAggregator: public RTPReceiver, public std::enable_shared_from_this<KeyframeRequestAggregator> {
+public:
+    explicit KeyframeRequestAggregator(DTLSICETransport *transport):
+        transport(transport) {}
+
+    int SendPLI(DWORD ssrc) override {
+        received++;
+
+        auto now_ms = steady_now_ms();
+        auto last_ms = last_forwarded_ms.load();
+
+        // Whoever wins the exchange forwards, everyone else inside the interval is suppressed.
+        if ((last_ms != 0 && now_ms - last_ms < min_interval_ms.load()) || !last_forwarded_ms.compare_exchange_strong(last_ms, now_ms)) {
+            suppressed++;
+            schedule_trailing(ssrc, last_ms, now_ms);
+            return 0;
+        }
+
+        forwarded++;
+        return transport->SendPLI(ssrc);
+    }
+
+    int Reset(DWORD ssrc) override {
+        return transport->Reset(ssrc);
+    }
+
+    void set_min_interval(uint32_t interval_ms) {
+        min_interval_ms = interval_ms;
+    }
+
+    KeyframeRequestStats get_stats() const {
+        return KeyframeRequestStats{
+            received.load(),
+            forwarded.load(),
+            suppressed.load(),
+        };
+    }
+
+private:
+    static constexpr int64_t default_min_interval_ms = 500;
+
+    static int64_t steady_now_ms() {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+    }
+
+    // A subscriber whose loss came after the forwarded keyframe went out would otherwise freeze
+    // until its own retry, so one PLI goes out when the interval ends if anything was suppressed.
+    //
+    // The tasks only hold the aggregator weakly. It is dropped before the connection that owns the
+    // transport, and removing the connection runs on the same loop as the tasks.
+    void schedule_trailing(DWORD ssrc, int64_t last_ms, int64_t now_ms) {
+        if (trailing_pending.exchange(true)) {
+            return;
+        }
+
+        auto delay = std::chrono::milliseconds(std::max<int64_t>(last_ms + min_interval_ms.load() - now_ms, 0));
+        auto weak_self = weak_from_this();
+
+        transport->GetTimeService().Async([weak_self, ssrc, delay](auto now) {
+            auto self = weak_self.lock();
+            if (!self) {
+                return;
+            }
+
+            self->trailing_timer = self->transport->GetTimeService().CreateTimer(delay, [weak_self, ssrc](auto now) {
+                if (auto self = weak_self.lock()) {
+                    self->send_trailing(ssrc);
+                }
+            });
+        });
+    }
+
+    void send_trailing(DWORD ssrc) {
+        trailing_pending = false;
+        last_forwarded_ms = steady_now_ms();
+        forwarded++;
+        transport->SendPLI(ssrc);
+    }
+
+    DTLSICETransport *transport;
+    std::atomic<int64_t> min_interval_ms {default_min_interval_ms};
+    std::atomic<int64_t> last_forwarded_ms {0};
+    std::atomic<bool> trailing_pending {false};
+    // Only touched on the transport's loop.
+    Timer::shared trailing_timer;
+    std::atomic<uint64_t> received {0};
+    std::atomic<uint64_t> forwarded {0};
+    std::atomic<uint64_t> suppressed {0};
+};
+
+OwnedRtpIncomingSourceGroup::OwnedRtpIncomingSourceGroup(std::shared_ptr<OwnedRtpBundleTransportConnection> connection, std::unique_ptr<RTPIncomingSourceGroup> source_group):
+    connection(std::move(connection)), source_group(std::move(source_group)) {
+    keyframe_requests = std::make_shared<KeyframeRequestAggregator>((*this->connection)->transport);
+}
+
+OwnedRtpIncomingSourceGroup::~OwnedRtpIncomingSourceGroup() {
+    if (keyframe_cache) {
+        source_group->RemoveListener(keyframe_cache.get());
+    }
+
+    (*connection)->transport->RemoveIncomingSourceGroup(source_group.get());
+}
+
+RTPIncomingSourceGroup *OwnedRtpIncomingSourceGroup::operator->() {
+    return source_group.get();
+}
+
+void OwnedRtpIncomingSourceGroup::enable_keyframe_cache(size_t max_packets) {
+    if (std::atomic_load(&keyframe_cache)) {
+        return;
+    }
+
+    auto cache = std::make_shared<KeyframeCache>(max_packets);
+    source_group->AddListener(cache.get());
+    std::atomic_store(&keyframe_cache, std::move(cache));
+}
+
+std::shared_ptr<KeyframeCache> OwnedRtpIncomingSourceGroup::get_keyframe_cache() const {
+    return std::atomic_load(&keyframe_cache);
+}
+
+KeyframeRequestAggregator &OwnedRtpIncomingSourceGroup::get_keyframe_requests() {
+    return *keyframe_requests;
+}
+
+RtpIncomingSourceGroupFacade::RtpIncomingSourceGroupFacade(std::shared_ptr<OwnedRtpIncomingSourceGroup> source_group):
+    source_group(std::move(source_group)) {}
+
+RtpIncomingSourceGroupFacade::~RtpIncomingSourceGroupFacade() {
+    release_on_teardown_thread(std::move(source_group));
+}
+
+std::unique_ptr<RtpPacketTapFacade> RtpIncomingSourceGroupFacade::add_packet_listener(rust::Box<RtpPacketListenerRustAdapter> listener) {
+    return std::make_unique<RtpPacketTapFacade>(source_group, std::move(listener));
+}
+
+std::unique_ptr<MediaFrameTapFacade> RtpIncomingSourceGroupFacade::add_media_frame_listener(rust::Box<MediaFrameListenerRustAdapter> listener) {
+    return std::make_unique<MediaFrameTapFacade>(source_group, std::move(listener));
+}
+
+void RtpIncomingSourceGroupFacade::enable_keyframe_cache(size_t max_packets) {
+    source_group->enable_keyframe_cache(max_packets);
+}
+
+void RtpIncomingSourceGroupFacade::set_keyframe_request_interval(uint32_t min_interval_ms) {
+    source_group->get_keyframe_requests().set_min_interval(min_interval_ms);
+}
+
+KeyframeRequestStats RtpIncomingSourceGroupFacade::get_keyframe_request_stats() const {
+    return source_group->get_keyframe_requests().get_stats();
+}
+
+RtpPacketFacade::RtpPacketFacade(RTPPacket::shared packet):
+    packet(std::move(packet)) {}
+
+uint32_t RtpPacketFacade::get_ssrc() const {
+    return packet->GetSSRC();
+}
+
+uint16_t RtpPacketFacade::get_sequence_number() const {
+    return packet->GetSeqNum();
+}
+
+uint32_t RtpPacketFacade::get_timestamp() const {
+    return packet->GetTimestamp();
+}
+
+uint8_t RtpPacketFacade::get_payload_type() const {
+    return packet->GetPayloadType();
+}
+
+bool RtpPacketFacade::get_marker() const {
+    return packet->GetMark();
+}
+
+bool RtpPacketFacade::is_key_frame() const {
+    return packet->IsKeyFrame();
+}
+
+rust::Slice<const uint8_t> RtpPacketFacade::get_payload() const {
+    return rust::Slice<const uint8_t>(packet->GetMediaData(), packet->GetMediaLength());
+}
+
+std::unique_ptr<RtpPacketFacade> RtpPacketFacade::retain() const {
+    return std::make_unique<RtpPacketFacade>(packet);
+}
+
+// Like the DTLS listener this runs on the event loop thread, but here handing every packet over
+// to Rust is the point. Listeners need to be quick and retain() anything they want to process later.
+struct RtpPacketListenerCxxAdapter: RTPIncomingMediaStream::Listener {
+    explicit RtpPacketListenerCxxAdapter(rust::Box<RtpPacketListenerRustAdapter> listener):
+        listener(std::move(listener)) {};
+
+    void onRTP(RTPIncomingMediaStream *stream, const RTPPacket::shared &packet) override {
+        RtpPacketFacade view(packet);
+        listener->on_rtp(view);
+    }
+
+    void onBye(RTPIncomingMediaStream *stream) override {}
+
+    void onEnded(RTPIncomingMediaStream *stream) override {}
+
+    rust::Box<RtpPacketListenerRustAdapter> listener;
+};
+
+RtpPacketTapFacade::RtpPacketTapFacade(std::shared_ptr<OwnedRtpIncomingSourceGroup> source_group, rust::Box<RtpPacketListenerRustAdapter> listener):
+    source_group(std::move(source_group)), listener(std::make_unique<RtpPacketListenerCxxAdapter>(std::move(listener))) {
+    (*this->source_group)->AddListener(this->listener.get());
+}
+
+RtpPacketTapFacade::~RtpPacketTapFacade() {
+    TeardownQueue::instance().push([source_group = std::move(source_group), listener = std::shared_ptr<RtpPacketListenerCxxAdapter>(std::move(listener))]() mutable {
+        (*source_group)->RemoveListener(listener.get());
+        listener.reset();
+        source_group.reset();
+    });
+}
+
+OwnedRtpOutgoingSourceGroup::OwnedRtpOutgoingSourceGroup(std::shared_ptr<OwnedRtpBundleTransportConnection> connection, std::unique_ptr<RTPOutgoingSourceGroup> source_group):
+        connection(std::move(connection)), source_group(std::move(source_group)) {}
+
+OwnedRtpOutgoingSourceGroup::~OwnedRtpOutgoingSourceGroup() {
+    (*connection)->transport->RemoveOutgoingSourceGroup(source_group.get());
+}
+
+RTPOutgoingSourceGroup *OwnedRtpOutgoingSourceGroup::operator->() {
+    return source_group.get();
+}
+
+RtpOutgoingSourceGroupFacade::RtpOutgoingSourceGroupFacade(std::shared_ptr<OwnedRtpOutgoingSourceGroup> source_group):
+        source_group(std::move(source_group)) {}
+
+RtpOutgoingSourceGroupFacade::~RtpOutgoingSourceGroupFacade() {
+    release_on_teardown_thread(std::move(source_group));
+}
+
+std::unique_ptr<RtpStreamTransponderFacade> RtpOutgoingSourceGroupFacade::add_transponder() {
+    return std::make_unique<RtpStreamTransponderFacade>(*this);
+}
+
+// Owns the incoming side of a transponder, and can defer moving it to a new source until that
+// source's first keyframe so subscribers keep decoding the old one instead of freezing. The
+// transponder rewrites sequence numbers and timestamps on SetIncoming, so the cut-over is
+// continuous for the receiver.
+//
+// `mutex` only guards the fields below and is never held while calling into media-server, as
+// onRTP takes it from inside the source group's dispatch. Our own listener is added and removed
+// from tasks on the group's loop. Every request bumps `generation`, so a stale cut-over or cache
+// attach that is already queued gives up instead of overriding a newer one.
+class KeyframeSwitch: public RTPIncomingMediaStream::Listener, public std::enable_shared_from_this<KeyframeSwitch> {
+public:
+    explicit KeyframeSwitch(std::weak_ptr<RTPStreamTransponder> transponder):
+        transponder(std::move(transponder)) {}
+
+    ~KeyframeSwitch() override {
+        release_on_teardown_thread(std::move(attached));
+    }
+
+    void set_incoming(std::shared_ptr<OwnedRtpIncomingSourceGroup> incoming) {
+        std::shared_ptr<OwnedRtpIncomingSourceGroup> cancelled;
+        uint64_t request_generation;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            cancelled = take_pending_locked();
+            has_incoming = true;
+            request_generation = ++generation;
+        }
+
+        detach(std::move(cancelled));
+
+        if (!incoming->get_keyframe_cache()) {
+            attach(std::move(incoming), request_generation, {});
+            return;
+        }
+
+        // Attach and replay the cached keyframe from the loop thread, so no live packets for the
+        // source can be dispatched in between.
+        auto &time_service = (*incoming->connection)->transport->GetTimeService();
+        time_service.Async([self = shared_from_this(), incoming = std::move(incoming), request_generation](auto now) mutable {
+            auto packets = incoming->get_keyframe_cache()->snapshot();
+            self->attach(std::move(incoming), request_generation, packets);
+        });
+    }
 
-void logger_enable_debug(bool flag) {
-    Logger::EnableDebug(flag);
-}
+    void request(std::shared_ptr<OwnedRtpIncomingSourceGroup> incoming) {
+        std::shared_ptr<OwnedRtpIncomingSourceGroup> cancelled;
+        bool deferred;
 
-void logger_enable_ultra_debug(bool flag) {
-    Logger::EnableUltraDebug(flag);
-}
+        {
+            std::lock_guard<std::mutex> lock(mutex);
 
-void openssl_class_init() {
-    if (!OpenSSL::ClassInit()) {
-        throw std::runtime_error("openssl initialization failed");
+            deferred = has_incoming;
+            if (deferred) {
+                cancelled = take_pending_locked();
+                pending = incoming;
+                requested_at = std::chrono::steady_clock::now();
+                switch_pending = true;
+                ++generation;
+            }
+        }
+
+        // Nothing is being forwarded yet, so there is nothing to keep going until the keyframe.
+        if (!deferred) {
+            set_incoming(std::move(incoming));
+            return;
+        }
+
+        detach(std::move(cancelled));
+
+        auto &time_service = (*incoming->connection)->transport->GetTimeService();
+        time_service.Async([self = shared_from_this(), weak_incoming = std::weak_ptr<OwnedRtpIncomingSourceGroup>(incoming)](auto now) {
+            auto incoming = weak_incoming.lock();
+            if (!incoming || !self->is_pending(incoming)) {
+                release_on_teardown_thread(std::move(incoming));
+                return;
+            }
+
+            // Should this have been cancelled since, the detach task queued behind us removes it.
+            (*incoming)->AddListener(self.get());
+        });
+
+        incoming->get_keyframe_requests().SendPLI(incoming->source_group->media.ssrc);
     }
-}
 
-void dtls_connection_initialize() {
-    if (DTLSConnection::Initialize() == 0) {
-        throw std::runtime_error("dtls initialization failed");
+    void cancel() {
+        std::shared_ptr<OwnedRtpIncomingSourceGroup> cancelled;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            cancelled = take_pending_locked();
+            ++generation;
+        }
+
+        detach(std::move(cancelled));
+
+        // Wait out an attach that is already past its generation check, so the transponder can be
+        // released once this returns.
+        std::lock_guard<std::mutex> wait(transponder_mutex);
     }
-}
 
-rust::String dtls_connection_get_certificate_fingerprint(DtlsConnectionHash hash) {
-    auto fingerprint = DTLSConnection::GetCertificateFingerPrint(hash);
-    if (fingerprint.empty()) {
-        throw std::runtime_error("no certificate fingerprint for hash - dtls not initialized?");
+    RtpStreamTransponderSwitchStats get_stats() const {
+        return RtpStreamTransponderSwitchStats{
+            switch_pending.load(),
+            switch_count.load(),
+            last_switch_latency_ms.load(),
+        };
     }
 
-    return fingerprint;
-}
+    void onRTP(RTPIncomingMediaStream *stream, const RTPPacket::shared &packet) override {
+        std::weak_ptr<OwnedRtpIncomingSourceGroup> incoming;
+        TimeService *time_service = nullptr;
+        uint64_t request_generation;
 
-void rtp_transport_set_port_range(uint16_t min, uint16_t max) {
-    if (!RTPTransport::SetPortRange(min, max)) {
-        throw std::runtime_error("failed to set rtp port range");
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (!pending || stream != pending->source_group.get()) {
+                return;
+            }
+
+            // Hold on to everything from the keyframe onwards until the cut-over task runs.
+            if (pending_packets.empty()) {
+                if (!packet->IsKeyFrame()) {
+                    return;
+                }
+
+                incoming = pending;
+                time_service = &(*pending->connection)->transport->GetTimeService();
+                request_generation = generation;
+            }
+
+            pending_packets.push_back(packet);
+        }
+
+        // Listeners can't be changed from inside the dispatch, so finish on the next loop turn.
+        if (time_service) {
+            time_service->Async([self = shared_from_this(), incoming = std::move(incoming), request_generation](auto now) {
+                self->complete(incoming.lock(), request_generation);
+            });
+        }
+    }
+
+    void onBye(RTPIncomingMediaStream *stream) override {}
+
+    void onEnded(RTPIncomingMediaStream *stream) override {}
+
+private:
+    std::shared_ptr<OwnedRtpIncomingSourceGroup> take_pending_locked() {
+        pending_packets.clear();
+        switch_pending = false;
+
+        return std::move(pending);
+    }
+
+    bool is_pending(const std::shared_ptr<OwnedRtpIncomingSourceGroup> &incoming) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        return pending == incoming;
+    }
+
+    // Removes our listener from a group we were waiting on, from its loop.
+    void detach(std::shared_ptr<OwnedRtpIncomingSourceGroup> incoming) {
+        if (!incoming) {
+            return;
+        }
+
+        auto &time_service = (*incoming->connection)->transport->GetTimeService();
+        time_service.Async([self = shared_from_this(), incoming = std::move(incoming)](auto now) mutable {
+            (*incoming)->RemoveListener(self.get());
+            release_on_teardown_thread(std::move(incoming));
+        });
+    }
+
+    // Points the transponder at `incoming` unless a newer request came in, replaying `packets`.
+    // The group it was attached to before is only released after it has been moved off it.
+    bool attach(std::shared_ptr<OwnedRtpIncomingSourceGroup> incoming, uint64_t request_generation, const std::vector<RTPPacket::shared> &packets) {
+        std::shared_ptr<OwnedRtpIncomingSourceGroup> previous;
+
+        {
+            std::lock_guard<std::mutex> transponder_lock(transponder_mutex);
+
+            auto locked_transponder = transponder.lock();
+            if (!locked_transponder || !is_current(request_generation)) {
+                release_on_teardown_thread(std::move(incoming));
+                return false;
+            }
+
+            locked_transponder->SetIncoming(incoming->source_group.get(), &incoming->get_keyframe_requests());
+
+            for (const auto &packet : packets) {
+                locked_transponder->onRTP(incoming->source_group.get(), packet);
+            }
+
+            previous = std::move(attached);
+            attached = std::move(incoming);
+        }
+
+        release_on_teardown_thread(std::move(previous));
+
+        return true;
+    }
+
+    bool is_current(uint64_t request_generation) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        return request_generation == generation;
+    }
+
+    void complete(std::shared_ptr<OwnedRtpIncomingSourceGroup> incoming, uint64_t request_generation) {
+        std::vector<RTPPacket::shared> packets;
+        std::chrono::steady_clock::time_point switch_requested_at;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            // Cancelled or replaced by a newer request in the meantime.
+            if (!incoming || pending != incoming || request_generation != generation) {
+                release_on_teardown_thread(std::move(incoming));
+                return;
+            }
+
+            packets = std::move(pending_packets);
+            switch_requested_at = requested_at;
+            take_pending_locked();
+        }
+
+        (*incoming)->RemoveListener(this);
+
+        if (!attach(std::move(incoming), request_generation, packets)) {
+            return;
+        }
+
+        auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - switch_requested_at);
+        last_switch_latency_ms = latency.count();
+        switch_count++;
     }
+
+    std::mutex mutex;
+    std::shared_ptr<OwnedRtpIncomingSourceGroup> pending;
+    std::vector<RTPPacket::shared> pending_packets;
+    std::chrono::steady_clock::time_point requested_at;
+    uint64_t generation = 0;
+    bool has_incoming = false;
+
+    // Held across SetIncoming so transponder changes apply in order, never taken by onRTP.
+    std::mutex transponder_mutex;
+    std::weak_ptr<RTPStreamTransponder> transponder;
+    std::shared_ptr<OwnedRtpIncomingSourceGroup> attached;
+
+    std::atomic<bool> switch_pending {false};
+    std::atomic<uint64_t> switch_count {0};
+    std::atomic<uint64_t> last_switch_latency_ms {0};
+};
+
+// TODO: RTPStreamTransponder::onRTP clones every packet to rewrite SSRC / sequence number /
+//       timestamp for its outgoing group. Sharing the payload and only copying the header per
+//       subscriber needs a copy-on-write RTPPacket in media-server. Until then the bridge only
+//       avoids copies of its own (packet taps and keyframe replays hold RTPPacket::shared).
+// TODO: Subscriber NACKs are answered by DTLSICETransport from each RTPOutgoingSourceGroup's own
+//       packet history and are not forwarded upstream, while upstream NACKs are generated once per
+//       incoming stream by RTPLostPackets. A store shared between the outgoing groups fed by one
+//       incoming group (with hit/miss counters) has to live in media-server's RTCPNACK handling,
+//       there is no hook for it at the transponder level.
+
+RtpStreamTransponderFacade::RtpStreamTransponderFacade(RtpOutgoingSourceGroupFacade &outgoing) {
+    this->outgoing = outgoing.source_group;
+    transponder = std::make_shared<RTPStreamTransponder>(this->outgoing->source_group.get(), (*this->outgoing->connection)->transport);
+    keyframe_switch = std::make_shared<KeyframeSwitch>(transponder);
 }
 
-PropertiesFacade::operator const Properties &() const {
-    return properties;
+RtpStreamTransponderFacade::~RtpStreamTransponderFacade() {
+    // The transponder has to go before the source groups it is attached to.
+    TeardownQueue::instance().push([transponder = std::move(transponder), keyframe_switch = std::move(keyframe_switch), outgoing = std::move(outgoing)]() mutable {
+        keyframe_switch->cancel();
+        transponder.reset();
+        keyframe_switch.reset();
+        outgoing.reset();
+    });
 }
 
-void PropertiesFacade::set_int(rust::Str key, int value) {
-    std::string key_string = std::string(key);
-    properties.SetProperty(key_string.c_str(), value);
+void RtpStreamTransponderFacade::set_incoming(RtpIncomingSourceGroupFacade &new_incoming) {
+    keyframe_switch->set_incoming(new_incoming.source_group);
 }
 
-void PropertiesFacade::set_bool(rust::Str key, bool value) {
-    std::string key_string = std::string(key);
-    properties.SetProperty(key_string.c_str(), value);
+void RtpStreamTransponderFacade::set_incoming_on_keyframe(RtpIncomingSourceGroupFacade &new_incoming) {
+    keyframe_switch->request(new_incoming.source_group);
 }
 
-void PropertiesFacade::set_string(rust::Str key, rust::Str value) {
-    std::string key_string = std::string(key);
-    std::string value_string = std::string(value);
-    properties.SetProperty(key_string.c_str(), value_string.c_str());
+RtpStreamTransponderSwitchStats RtpStreamTransponderFacade::get_switch_stats() const {
+    return keyframe_switch->get_stats();
 }
 
-std::unique_ptr<PropertiesFacade> new_properties() {
-    return std::make_unique<PropertiesFacade>();
+void RtpStreamTransponderFacade::select_layer(uint8_t spatial_layer_id, uint8_t temporal_layer_id) {
+    transponder->SelectLayer(spatial_layer_id, temporal_layer_id);
 }
 
-struct DtlsIceTransportListenerCxxAdapter: DTLSICETransport::Listener {
-    explicit DtlsIceTransportListenerCxxAdapter(rust::Box<DtlsIceTransportListenerRustAdapter> listener):
-        listener(std::move(listener)) {};
+void RtpStreamTransponderFacade::set_maximum_layers(uint8_t max_spatial_layer_id, uint8_t max_temporal_layer_id) {
+    transponder->SetMaximumLayers(max_spatial_layer_id, max_temporal_layer_id);
+}
 
-    void onICETimeout() override {
-        listener->on_ice_timeout();
+// The layer selector only moves to a newly selected layer at the next switching point, so this is
+// what is being forwarded right now rather than what was last asked for.
+RtpLayerSelection RtpStreamTransponderFacade::get_current_layers() const {
+    return RtpLayerSelection{
+        static_cast<uint8_t>(transponder->GetSelectedSpatialLayerId()),
+        static_cast<uint8_t>(transponder->GetSelectedTemporalLayerId()),
+    };
+}
+
+// Keeps a few spare frame buffers around for each depacketized stream, so that retaining frames
+// only allocates until the pool has warmed up to the size of the stream's frames.
+class MediaFrameBufferPool {
+public:
+    std::vector<uint8_t> acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (buffers.empty()) {
+            return {};
+        }
+
+        auto buffer = std::move(buffers.back());
+        buffers.pop_back();
+
+        return buffer;
     }
 
-    void onDTLSStateChanged(const DtlsIceTransportDtlsState state) override {
-        listener->on_dtls_state_changed(state);
+    void release(std::vector<uint8_t> &&buffer) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (buffers.size() < max_idle_buffers) {
+            buffer.clear();
+            buffers.push_back(std::move(buffer));
+        }
     }
 
-    void onRemoteICECandidateActivated(const std::string &ip, uint16_t port, uint32_t priority) override {
-        listener->on_remote_ice_candidate_activated(ip, port, priority);
+private:
+    static constexpr size_t max_idle_buffers = 16;
+
+    std::mutex mutex;
+    std::vector<std::vector<uint8_t>> buffers;
+};
+
+// Retained frames are created and dropped at frame rate, so the facades themselves are recycled
+// through a process-wide free list (views live on the stack and never get here).
+class MediaFrameFacadeFreeList {
+public:
+    MediaFrameFacadeFreeList() {
+        spare.reserve(max_spare_facades);
+    }
+
+    void *allocate(size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (size == sizeof(MediaFrameFacade) && !spare.empty()) {
+                auto pointer = spare.back();
+                spare.pop_back();
+
+                return pointer;
+            }
+        }
+
+        return ::operator new(size);
+    }
+
+    void deallocate(void *pointer) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (spare.size() < max_spare_facades) {
+                spare.push_back(pointer);
+
+                return;
+            }
+        }
+
+        ::operator delete(pointer);
+    }
+
+    static MediaFrameFacadeFreeList &get() {
+        // Leaked, so that facades dropped during static destruction still have somewhere to go.
+        static auto free_list = new MediaFrameFacadeFreeList();
+
+        return *free_list;
     }
 
-    rust::Box<DtlsIceTransportListenerRustAdapter> listener;
+private:
+    static constexpr size_t max_spare_facades = 256;
+
+    std::mutex mutex;
+    std::vector<void *> spare;
 };
 
-OwnedRtpBundleTransportConnection::OwnedRtpBundleTransportConnection(std::shared_ptr<RTPBundleTransport> transport, RTPBundleTransport::Connection *connection):
-    transport(std::move(transport)), connection(connection) {}
+void *MediaFrameFacade::operator new(size_t size) {
+    return MediaFrameFacadeFreeList::get().allocate(size);
+}
 
-OwnedRtpBundleTransportConnection::~OwnedRtpBundleTransportConnection() {
-    transport->RemoveICETransport(connection->username);
+void MediaFrameFacade::operator delete(void *pointer) {
+    MediaFrameFacadeFreeList::get().deallocate(pointer);
 }
 
-RTPBundleTransport::Connection *OwnedRtpBundleTransportConnection::operator->() {
-    return connection;
+MediaFrameFacade::MediaFrameFacade(const MediaFrame &frame, std::shared_ptr<MediaFrameBufferPool> pool):
+    type(frame.GetType()), timestamp(frame.GetTimeStamp()), clock_rate(frame.GetClockRate()), intra(true),
+    data(frame.GetData()), length(frame.GetLength()), pool(std::move(pool)) {
+    if (type == MediaFrameType::Video) {
+        intra = static_cast<const VideoFrame &>(frame).IsIntra();
+    }
 }
 
-OwnedRtpIncomingSourceGroup::OwnedRtpIncomingSourceGroup(std::shared_ptr<OwnedRtpBundleTransportConnection> connection, std::unique_ptr<RTPIncomingSourceGroup> source_group):
-    connection(std::move(connection)), source_group(std::move(source_group)) {}
+MediaFrameFacade::MediaFrameFacade(const MediaFrameFacade &view, std::vector<uint8_t> buffer):
+    type(view.type), timestamp(view.timestamp), clock_rate(view.clock_rate), intra(view.intra),
+    buffer(std::move(buffer)), pool(view.pool) {
+    this->buffer.assign(view.data, view.data + view.length);
+    data = this->buffer.data();
+    length = this->buffer.size();
+}
 
-OwnedRtpIncomingSourceGroup::~OwnedRtpIncomingSourceGroup() {
-    (*connection)->transport->RemoveIncomingSourceGroup(source_group.get());
+MediaFrameFacade::~MediaFrameFacade() {
+    // Views never own a buffer, so this only returns retained frames' buffers.
+    if (buffer.capacity() != 0) {
+        pool->release(std::move(buffer));
+    }
 }
 
-RTPIncomingSourceGroup *OwnedRtpIncomingSourceGroup::operator->() {
-    return source_group.get();
+MediaFrameType MediaFrameFacade::get_type() const {
+    return type;
 }
 
-RtpIncomingSourceGroupFacade::RtpIncomingSourceGroupFacade(std::shared_ptr<OwnedRtpIncomingSourceGroup> source_group):
-    source_group(std::move(source_group)) {}
+uint64_t MediaFrameFacade::get_timestamp() const {
+    return timestamp;
+}
 
-OwnedRtpOutgoingSourceGroup::OwnedRtpOutgoingSourceGroup(std::shared_ptr<OwnedRtpBundleTransportConnection> connection, std::unique_ptr<RTPOutgoingSourceGroup> source_group):
-        connection(std::move(connection)), source_group(std::move(source_group)) {}
+uint32_t MediaFrameFacade::get_clock_rate() const {
+    return clock_rate;
+}
 
-OwnedRtpOutgoingSourceGroup::~OwnedRtpOutgoingSourceGroup() {
-    (*connection)->transport->RemoveOutgoingSourceGroup(source_group.get());
+bool MediaFrameFacade::is_intra() const {
+    return intra;
 }
 
-RTPOutgoingSourceGroup *OwnedRtpOutgoingSourceGroup::operator->() {
-    return source_group.get();
+rust::Slice<const uint8_t> MediaFrameFacade::get_data() const {
+    return rust::Slice<const uint8_t>(data, length);
 }
 
-RtpOutgoingSourceGroupFacade::RtpOutgoingSourceGroupFacade(std::shared_ptr<OwnedRtpOutgoingSourceGroup> source_group):
-        source_group(std::move(source_group)) {}
+std::unique_ptr<MediaFrameFacade> MediaFrameFacade::retain() const {
+    return std::make_unique<MediaFrameFacade>(*this, pool->acquire());
+}
 
-std::unique_ptr<RtpStreamTransponderFacade> RtpOutgoingSourceGroupFacade::add_transponder() {
-    return std::make_unique<RtpStreamTransponderFacade>(*this);
+struct MediaFrameListenerCxxAdapter: MediaFrame::Listener {
+    explicit MediaFrameListenerCxxAdapter(rust::Box<MediaFrameListenerRustAdapter> listener):
+        listener(std::move(listener)), pool(std::make_shared<MediaFrameBufferPool>()) {};
+
+    void onMediaFrame(const MediaFrame &frame) override {
+        MediaFrameFacade view(frame, pool);
+        listener->on_media_frame(view);
+    }
+
+    void onMediaFrame(DWORD ssrc, const MediaFrame &frame) override {
+        onMediaFrame(frame);
+    }
+
+    rust::Box<MediaFrameListenerRustAdapter> listener;
+    std::shared_ptr<MediaFrameBufferPool> pool;
+};
+
+MediaFrameTapFacade::MediaFrameTapFacade(std::shared_ptr<OwnedRtpIncomingSourceGroup> source_group, rust::Box<MediaFrameListenerRustAdapter> listener):
+    source_group(std::move(source_group)), listener(std::make_unique<MediaFrameListenerCxxAdapter>(std::move(listener))) {
+    depacketizer = std::make_unique<RTPIncomingMediaStreamDepacketizer>(this->source_group->operator->());
+    depacketizer->AddMediaListener(this->listener.get());
 }
 
-RtpStreamTransponderFacade::RtpStreamTransponderFacade(RtpOutgoingSourceGroupFacade &outgoing) {
-    this->outgoing = outgoing.source_group;
-    transponder = std::make_unique<RTPStreamTransponder>(this->outgoing->source_group.get(), (*this->outgoing->connection)->transport);
+MediaFrameTapFacade::~MediaFrameTapFacade() {
+    TeardownQueue::instance().push([source_group = std::move(source_group), depacketizer = std::shared_ptr<RTPIncomingMediaStreamDepacketizer>(std::move(depacketizer)), listener = std::shared_ptr<MediaFrameListenerCxxAdapter>(std::move(listener))]() mutable {
+        depacketizer->RemoveMediaListener(listener.get());
+        depacketizer->Stop();
+        depacketizer.reset();
+        listener.reset();
+        source_group.reset();
+    });
 }
 
-void RtpStreamTransponderFacade::set_incoming(RtpIncomingSourceGroupFacade &new_incoming) {
-    incoming = new_incoming.source_group;
-    transponder->SetIncoming(incoming->source_group.get(), (*incoming->connection)->transport);
+RtpSourceGroupBatchFacade::RtpSourceGroupBatchFacade(std::vector<std::unique_ptr<RtpIncomingSourceGroupFacade>> incoming, std::vector<std::unique_ptr<RtpOutgoingSourceGroupFacade>> outgoing):
+    incoming(std::move(incoming)), outgoing(std::move(outgoing)) {}
+
+size_t RtpSourceGroupBatchFacade::get_incoming_count() const {
+    return incoming.size();
+}
+
+size_t RtpSourceGroupBatchFacade::get_outgoing_count() const {
+    return outgoing.size();
+}
+
+std::unique_ptr<RtpIncomingSourceGroupFacade> RtpSourceGroupBatchFacade::take_incoming(size_t index) {
+    if (index >= incoming.size() || !incoming[index]) {
+        throw std::out_of_range("incoming source group already taken or out of range");
+    }
+
+    return std::move(incoming[index]);
+}
+
+std::unique_ptr<RtpOutgoingSourceGroupFacade> RtpSourceGroupBatchFacade::take_outgoing(size_t index) {
+    if (index >= outgoing.size() || !outgoing[index]) {
+        throw std::out_of_range("outgoing source group already taken or out of range");
+    }
+
+    return std::move(outgoing[index]);
 }
 
 RtpBundleTransportConnectionFacade::RtpBundleTransportConnectionFacade(std::shared_ptr<RTPBundleTransport> transport, std::shared_ptr<OwnedRtpBundleTransportConnection> connection):
     transport(std::move(transport)), connection(std::move(connection)), active_listener(nullptr) {}
 
 RtpBundleTransportConnectionFacade::~RtpBundleTransportConnectionFacade() {
-    (*connection)->transport->SetListener(nullptr);
-    active_listener = nullptr;
+    TeardownQueue::instance().push([transport = std::move(transport), connection = std::move(connection), listener = std::shared_ptr<DtlsIceTransportListenerCxxAdapter>(std::move(active_listener))]() mutable {
+        (*connection)->transport->SetListener(nullptr);
+
+        // Same as when the queue is replaced, the loop may still be inside a callback on it.
+        transport->GetTimeService().Future([](auto now) {}).wait();
+        listener.reset();
+        connection.reset();
+        transport.reset();
+    });
 }
 
-void RtpBundleTransportConnectionFacade::set_listener(rust::Box<DtlsIceTransportListenerRustAdapter> listener) {
-    active_listener = std::make_unique<DtlsIceTransportListenerCxxAdapter>(std::move(listener));
-    (*connection)->transport->SetListener(active_listener.get());
+std::unique_ptr<DtlsIceTransportEventQueueFacade> RtpBundleTransportConnectionFacade::set_event_queue(size_t capacity, rust::Box<DtlsIceTransportEventNotifierRustAdapter> notifier) {
+    auto queue = std::make_shared<DtlsIceTransportEventQueue>(capacity);
+
+    auto listener = std::make_unique<DtlsIceTransportListenerCxxAdapter>(queue, std::move(notifier));
+    (*connection)->transport->SetListener(listener.get());
+
+    // The loop may still be inside a callback on the listener being replaced, so only free it from
+    // the teardown thread once the loop has gone round after the switch.
+    if (active_listener) {
+        TeardownQueue::instance().push([transport = transport, previous = std::shared_ptr<DtlsIceTransportListenerCxxAdapter>(std::move(active_listener))]() mutable {
+            transport->GetTimeService().Future([](auto now) {}).wait();
+            previous.reset();
+        });
+    }
+
+    active_listener = std::move(listener);
+
+    return std::make_unique<DtlsIceTransportEventQueueFacade>(std::move(queue));
 }
 
 void RtpBundleTransportConnectionFacade::set_remote_properties(const PropertiesFacade &properties) {
@@ -166,14 +1798,45 @@ void RtpBundleTransportConnectionFacade::set_local_properties(const PropertiesFa
     (*connection)->transport->SetLocalProperties(properties);
 }
 
-std::unique_ptr<RtpIncomingSourceGroupFacade> RtpBundleTransportConnectionFacade::add_incoming_source_group(MediaFrameType type, rust::Str mid, rust::Str rid, uint32_t mediaSsrc, uint32_t rtxSsrc) {
-    auto source_group = std::make_unique<RTPIncomingSourceGroup>(type, transport->GetTimeService());
+// TODO: SetRemoteProperties fills the connection's RTPMap of extensions, which
+//       RTPHeaderExtension::Parse then looks every id up in per packet. A per-connection id -> decoder
+//       table covering only the negotiated extensions would be built at this point, upstream.
+void RtpBundleTransportConnectionFacade::set_remote_rtp_parameters(const RtpMediaParameters &audio, const RtpMediaParameters &video) {
+    (*connection)->transport->SetRemoteProperties(make_rtp_properties(audio, video));
+}
+
+void RtpBundleTransportConnectionFacade::set_local_rtp_parameters(const RtpMediaParameters &audio, const RtpMediaParameters &video) {
+    (*connection)->transport->SetLocalProperties(make_rtp_properties(audio, video));
+}
+
+static std::unique_ptr<RTPIncomingSourceGroup> make_incoming_source_group(TimeService &time_service, MediaFrameType type, rust::Str mid, rust::Str rid, uint32_t mediaSsrc, uint32_t rtxSsrc) {
+    auto source_group = std::make_unique<RTPIncomingSourceGroup>(type, time_service);
 
     source_group->mid = std::string(mid);
     source_group->rid = std::string(rid);
     source_group->media.ssrc = mediaSsrc;
     source_group->rtx.ssrc = rtxSsrc;
 
+    return source_group;
+}
+
+static std::unique_ptr<RTPOutgoingSourceGroup> make_outgoing_source_group(MediaFrameType type, rust::Str mid, uint32_t mediaSsrc, uint32_t rtxSsrc) {
+    auto mid_string = std::string(mid);
+    auto source_group = std::make_unique<RTPOutgoingSourceGroup>(mid_string, type);
+
+    source_group->media.ssrc = mediaSsrc;
+    source_group->fec.ssrc = 0;
+    source_group->rtx.ssrc = rtxSsrc;
+
+    return source_group;
+}
+
+// TODO: DTLSICETransport routes packets to incoming groups through std::maps keyed by SSRC and by
+//       MID/RID. A flat map (inline for the usual handful of SSRCs) and a MID/RID table built on
+//       AddIncomingSourceGroup would have to replace those inside DTLSICETransport itself.
+std::unique_ptr<RtpIncomingSourceGroupFacade> RtpBundleTransportConnectionFacade::add_incoming_source_group(MediaFrameType type, rust::Str mid, rust::Str rid, uint32_t mediaSsrc, uint32_t rtxSsrc) {
+    auto source_group = make_incoming_source_group(transport->GetTimeService(), type, mid, rid, mediaSsrc, rtxSsrc);
+
     if (!(*connection)->transport->AddIncomingSourceGroup(source_group.get())) {
         throw std::runtime_error("failed to add incoming source group");
     }
@@ -184,12 +1847,7 @@ std::unique_ptr<RtpIncomingSourceGroupFacade> RtpBundleTransportConnectionFacade
 }
 
 std::unique_ptr<RtpOutgoingSourceGroupFacade> RtpBundleTransportConnectionFacade::add_outgoing_source_group(MediaFrameType type, rust::Str mid, uint32_t mediaSsrc, uint32_t rtxSsrc) {
-    auto mid_string = std::string(mid);
-    auto source_group = std::make_unique<RTPOutgoingSourceGroup>(mid_string, type);
-
-    source_group->media.ssrc = mediaSsrc;
-    source_group->fec.ssrc = 0;
-    source_group->rtx.ssrc = rtxSsrc;
+    auto source_group = make_outgoing_source_group(type, mid, mediaSsrc, rtxSsrc);
 
     if (!(*connection)->transport->AddOutgoingSourceGroup(source_group.get())) {
         throw std::runtime_error("failed to add outgoing source group");
@@ -200,23 +1858,126 @@ std::unique_ptr<RtpOutgoingSourceGroupFacade> RtpBundleTransportConnectionFacade
     return std::make_unique<RtpOutgoingSourceGroupFacade>(std::move(owned_source_group));
 }
 
+std::unique_ptr<RtpSourceGroupBatchFacade> RtpBundleTransportConnectionFacade::add_source_groups(rust::Slice<const RtpIncomingSourceGroupParameters> incoming, rust::Slice<const RtpOutgoingSourceGroupParameters> outgoing) {
+    std::vector<std::unique_ptr<RTPIncomingSourceGroup>> incoming_groups;
+    incoming_groups.reserve(incoming.size());
+    for (const auto &parameters : incoming) {
+        incoming_groups.push_back(make_incoming_source_group(transport->GetTimeService(), parameters.kind, parameters.mid, parameters.rid, parameters.media_ssrc, parameters.rtx_ssrc));
+    }
+
+    std::vector<std::unique_ptr<RTPOutgoingSourceGroup>> outgoing_groups;
+    outgoing_groups.reserve(outgoing.size());
+    for (const auto &parameters : outgoing) {
+        outgoing_groups.push_back(make_outgoing_source_group(parameters.kind, parameters.mid, parameters.media_ssrc, parameters.rtx_ssrc));
+    }
+
+    // Every Add*SourceGroup call synchronises with the event loop, so install them all from a single
+    // task on the loop instead of paying for a round trip per source group.
+    size_t incoming_added = 0;
+    size_t outgoing_added = 0;
+    auto dtls_ice_transport = (*connection)->transport;
+    transport->GetTimeService().Future([&](auto now) {
+        for (; incoming_added < incoming_groups.size(); ++incoming_added) {
+            if (!dtls_ice_transport->AddIncomingSourceGroup(incoming_groups[incoming_added].get())) {
+                return;
+            }
+        }
+
+        for (; outgoing_added < outgoing_groups.size(); ++outgoing_added) {
+            if (!dtls_ice_transport->AddOutgoingSourceGroup(outgoing_groups[outgoing_added].get())) {
+                return;
+            }
+        }
+    }).wait();
+
+    if (incoming_added != incoming_groups.size() || outgoing_added != outgoing_groups.size()) {
+        for (size_t i = 0; i < incoming_added; ++i) {
+            dtls_ice_transport->RemoveIncomingSourceGroup(incoming_groups[i].get());
+        }
+
+        for (size_t i = 0; i < outgoing_added; ++i) {
+            dtls_ice_transport->RemoveOutgoingSourceGroup(outgoing_groups[i].get());
+        }
+
+        throw std::runtime_error("failed to add source groups");
+    }
+
+    std::vector<std::unique_ptr<RtpIncomingSourceGroupFacade>> incoming_facades;
+    incoming_facades.reserve(incoming_groups.size());
+    for (auto &source_group : incoming_groups) {
+        auto owned_source_group = std::make_shared<OwnedRtpIncomingSourceGroup>(connection, std::move(source_group));
+        incoming_facades.push_back(std::make_unique<RtpIncomingSourceGroupFacade>(std::move(owned_source_group)));
+    }
+
+    std::vector<std::unique_ptr<RtpOutgoingSourceGroupFacade>> outgoing_facades;
+    outgoing_facades.reserve(outgoing_groups.size());
+    for (auto &source_group : outgoing_groups) {
+        auto owned_source_group = std::make_shared<OwnedRtpOutgoingSourceGroup>(connection, std::move(source_group));
+        outgoing_facades.push_back(std::make_unique<RtpOutgoingSourceGroupFacade>(std::move(owned_source_group)));
+    }
+
+    return std::make_unique<RtpSourceGroupBatchFacade>(std::move(incoming_facades), std::move(outgoing_facades));
+}
+
 void RtpBundleTransportConnectionFacade::add_remote_candidate(rust::Str ip, uint16_t port) {
     std::string ipString = std::string(ip);
     transport->AddRemoteCandidate((*connection)->username, ipString.c_str(), port);
 }
 
+// Socket path work that has to happen in media-server before the facade can expose it:
+//
+// TODO: The socket I/O for RTPBundleTransport lives in media-server's EventLoop, which reads and
+//       writes a single datagram per syscall. Batching with recvmmsg/sendmmsg needs to be done
+//       there (and plumbed through the RTPBundleTransport constructor) before we can toggle it here.
+// TODO: Same goes for an io_uring backend, EventLoop is a concrete poll() loop rather than an
+//       interface, so there is nothing for the facade to select between yet.
+// TODO: UDP_SEGMENT / UDP_GRO would also have to be set on the socket EventLoop owns, and GSO needs
+//       RTPBundleTransport::Send to coalesce per ICERemoteCandidate. No stats to expose until then.
+// TODO: SRTP protect runs in DTLSICETransport::Send on the transport's loop thread. Handing it to a
+//       crypto worker pool needs media-server to split protect from send; meanwhile
+//       RtpBundleTransportPoolFacade spreads connections (and their SRTP work) over one loop per core.
+// TODO: DTLS handshakes run inside DTLSConnection on the transport's loop as datagrams arrive. Moving
+//       the OpenSSL work to a worker pool (and handing the SRTP keys back) has to happen in dtls.cpp;
+//       from here we can only make them cheaper (ECDSA certificates) and spread them over shards.
+// TODO: Datagrams are matched to connections through RTPBundleTransport's std::map of ICE username
+//       and remote candidate; a flat (ip, port) hash with a last-hit cache would replace those maps
+//       in RTPBundleTransport::Read. Sharding only keeps each map smaller in the meantime.
+
 RtpBundleTransportFacade::RtpBundleTransportFacade(uint16_t port):
-    transport(std::make_shared<RTPBundleTransport>()) {
+    transport(std::make_shared<RTPBundleTransport>()), connection_count(std::make_shared<std::atomic<size_t>>(0)) {
     if (transport->Init(port) == 0) {
         throw std::runtime_error("failed to open socket");
     }
 }
 
+RtpBundleTransportFacade::~RtpBundleTransportFacade() {
+    release_on_teardown_thread(std::move(transport));
+}
+
 uint16_t RtpBundleTransportFacade::get_local_port() const {
     return (uint16_t)transport->GetLocalPort();
 }
 
+size_t RtpBundleTransportFacade::get_connection_count() const {
+    return connection_count->load();
+}
+
+bool RtpBundleTransportFacade::set_affinity(int cpu) {
+    return transport->SetAffinity(cpu);
+}
+
+// TODO: STUN binding requests are parsed by STUNMessage into heap-allocated attributes and checked
+//       with a fresh HMAC-SHA1 from the ICE password each time. An in-place fast path with the key
+//       schedule computed here, when the connection is added, needs a hook in RTPBundleTransport.
 std::unique_ptr<RtpBundleTransportConnectionFacade> RtpBundleTransportFacade::add_ice_transport(rust::Str username, const PropertiesFacade &properties) {
+    return add_ice_transport_with_properties(username, properties);
+}
+
+std::unique_ptr<RtpBundleTransportConnectionFacade> RtpBundleTransportFacade::add_ice_transport_with_parameters(rust::Str username, const IceTransportParameters &parameters) {
+    return add_ice_transport_with_properties(username, make_ice_transport_properties(parameters));
+}
+
+std::unique_ptr<RtpBundleTransportConnectionFacade> RtpBundleTransportFacade::add_ice_transport_with_properties(rust::Str username, const Properties &properties) {
     std::string username_string = std::string(username);
 
     auto connection = transport->AddICETransport(username_string, properties);
@@ -224,7 +1985,7 @@ std::unique_ptr<RtpBundleTransportConnectionFacade> RtpBundleTransportFacade::ad
         throw std::runtime_error("ice transport creation failed");
     }
 
-    auto owned_connection = std::make_shared<OwnedRtpBundleTransportConnection>(transport, connection);
+    auto owned_connection = std::make_shared<OwnedRtpBundleTransportConnection>(transport, connection_count, connection);
 
     return std::make_unique<RtpBundleTransportConnectionFacade>(transport, owned_connection);
 }
@@ -232,3 +1993,74 @@ std::unique_ptr<RtpBundleTransportConnectionFacade> RtpBundleTransportFacade::ad
 std::unique_ptr<RtpBundleTransportFacade> new_rtp_bundle_transport(uint16_t port) {
     return std::make_unique<RtpBundleTransportFacade>(port);
 }
+
+RtpBundleTransportPoolFacade::RtpBundleTransportPoolFacade(size_t shard_count) {
+    auto cpu_count = std::max(std::thread::hardware_concurrency(), 1u);
+    if (shard_count == 0) {
+        shard_count = cpu_count;
+    }
+
+    shards.reserve(shard_count);
+    shard_mutexes = std::make_unique<std::mutex[]>(shard_count);
+    for (size_t i = 0; i < shard_count; ++i) {
+        auto shard = std::make_unique<RtpBundleTransportFacade>(0);
+
+        // Pinning is only an optimisation, an unpinned shard still works fine.
+        if (!shard->set_affinity((int)(i % cpu_count))) {
+            Debug("-RtpBundleTransportPoolFacade() failed to set affinity for shard %zu\n", i);
+        }
+
+        shards.push_back(std::move(shard));
+    }
+}
+
+size_t RtpBundleTransportPoolFacade::get_shard_count() const {
+    return shards.size();
+}
+
+size_t RtpBundleTransportPoolFacade::get_shard_for_username(rust::Str username) const {
+    auto hash = std::hash<std::string_view>{}(std::string_view(username.data(), username.size()));
+    return hash % shards.size();
+}
+
+uint16_t RtpBundleTransportPoolFacade::get_shard_local_port(size_t shard) const {
+    if (shard >= shards.size()) {
+        throw std::out_of_range("shard index out of range");
+    }
+
+    return shards[shard]->get_local_port();
+}
+
+rust::Vec<RtpBundleTransportShardStats> RtpBundleTransportPoolFacade::get_shard_stats() const {
+    rust::Vec<RtpBundleTransportShardStats> stats;
+    stats.reserve(shards.size());
+
+    for (const auto &shard : shards) {
+        stats.push_back(RtpBundleTransportShardStats {
+            shard->get_local_port(),
+            shard->get_connection_count(),
+        });
+    }
+
+    return stats;
+}
+
+// Adding a connection blocks on the shard's loop, so only joins that land on the same shard wait
+// for each other.
+std::unique_ptr<RtpBundleTransportConnectionFacade> RtpBundleTransportPoolFacade::add_ice_transport(rust::Str username, const PropertiesFacade &properties) const {
+    auto shard = get_shard_for_username(username);
+    std::lock_guard<std::mutex> lock(shard_mutexes[shard]);
+
+    return shards[shard]->add_ice_transport(username, properties);
+}
+
+std::unique_ptr<RtpBundleTransportConnectionFacade> RtpBundleTransportPoolFacade::add_ice_transport_with_parameters(rust::Str username, const IceTransportParameters &parameters) const {
+    auto shard = get_shard_for_username(username);
+    std::lock_guard<std::mutex> lock(shard_mutexes[shard]);
+
+    return shards[shard]->add_ice_transport_with_parameters(username, parameters);
+}
+
+std::unique_ptr<RtpBundleTransportPoolFacade> new_rtp_bundle_transport_pool(size_t shard_count) {
+    return std::make_unique<RtpBundleTransportPoolFacade>(shard_count);
+}
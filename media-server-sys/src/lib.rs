@@ -30,16 +30,140 @@ mod ffi {
         Text,
     }
 
+    /// Spatial and temporal layer ids for simulcast / SVC forwarding, 255 means no limit.
+    #[derive(Debug, Copy, Clone, PartialEq, Eq)]
+    struct RtpLayerSelection {
+        spatial_layer_id: u8,
+        temporal_layer_id: u8,
+    }
+
+    /// Keyframe requests from a source group's transponders, and how many reached the publisher.
+    #[derive(Debug, Copy, Clone)]
+    struct KeyframeRequestStats {
+        received: u64,
+        forwarded: u64,
+        suppressed: u64,
+    }
+
+    #[derive(Debug, Copy, Clone)]
+    struct RtpStreamTransponderSwitchStats {
+        /// A keyframe-aligned switch is waiting for the new source's keyframe.
+        pending: bool,
+        switch_count: u64,
+        /// Time from requesting the switch to cutting over, for the most recent switch.
+        last_switch_latency_ms: u64,
+    }
+
+    #[derive(Debug, Copy, Clone)]
+    struct RtpBundleTransportShardStats {
+        local_port: u16,
+        connection_count: usize,
+    }
+
+    #[derive(Debug, Copy, Clone)]
+    enum DtlsIceTransportEventKind {
+        IceTimeout,
+        DtlsStateChanged,
+        RemoteIceCandidateActivated,
+    }
+
+    #[derive(Debug)]
+    struct DtlsIceTransportEvent {
+        kind: DtlsIceTransportEventKind,
+        dtls_state: DtlsIceTransportDtlsState,
+        ip: String,
+        port: u16,
+        priority: u32,
+    }
+
+    #[derive(Debug, Copy, Clone)]
+    struct DtlsIceTransportEventQueueStats {
+        capacity: usize,
+        depth: usize,
+        dropped: u64,
+    }
+
+    /// Key used for generated DTLS certificates, ECDSA makes handshakes considerably cheaper.
+    #[repr(u8)]
+    #[derive(Debug, Copy, Clone, PartialEq, Eq)]
+    enum DtlsCertificateKeyType {
+        EcdsaP256,
+        Rsa2048,
+    }
+
+    /// SRTP protection profiles for the DTLS handshake to negotiate between.
+    #[repr(u8)]
+    #[derive(Debug, Copy, Clone, PartialEq, Eq)]
+    enum SrtpProtectionProfile {
+        AeadAes128Gcm,
+        AeadAes256Gcm,
+        Aes128CmSha1_80,
+        Aes128CmSha1_32,
+    }
+
+    #[derive(Debug, Copy, Clone)]
+    struct SrtpBenchmarkResult {
+        protect_nanos: u64,
+        unprotect_nanos: u64,
+    }
+
+    struct IceTransportParameters<'a> {
+        local_username: &'a str,
+        local_password: &'a str,
+        remote_username: &'a str,
+        remote_password: &'a str,
+        dtls_setup: &'a str,
+        dtls_hash: &'a str,
+        dtls_fingerprint: &'a str,
+        disable_stun_keep_alive: bool,
+        /// In order of preference, empty offers AES-128-GCM with AES-128-CM-SHA1-80 as fallback.
+        srtp_protection_profiles: &'a [SrtpProtectionProfile],
+    }
+
+    struct RtpCodecParameters<'a> {
+        name: &'a str,
+        payload_type: u8,
+        /// 0 if the codec has no associated RTX payload type.
+        rtx_payload_type: u8,
+    }
+
+    struct RtpExtensionParameters<'a> {
+        id: u8,
+        uri: &'a str,
+    }
+
+    struct RtpMediaParameters<'a> {
+        codecs: &'a [RtpCodecParameters<'a>],
+        extensions: &'a [RtpExtensionParameters<'a>],
+    }
+
+    struct RtpIncomingSourceGroupParameters<'a> {
+        kind: MediaFrameType,
+        mid: &'a str,
+        rid: &'a str,
+        media_ssrc: u32,
+        rtx_ssrc: u32,
+    }
+
+    struct RtpOutgoingSourceGroupParameters<'a> {
+        kind: MediaFrameType,
+        mid: &'a str,
+        media_ssrc: u32,
+        rtx_ssrc: u32,
+    }
+
     extern "Rust" {
-        type DtlsIceTransportListenerRustAdapter;
-        fn on_ice_timeout(self: &mut DtlsIceTransportListenerRustAdapter);
-        fn on_dtls_state_changed(self: &mut DtlsIceTransportListenerRustAdapter, state: DtlsIceTransportDtlsState);
-        fn on_remote_ice_candidate_activated(
-            self: &mut DtlsIceTransportListenerRustAdapter,
-            ip: &str,
-            port: u16,
-            priority: u32,
-        );
+        type DtlsIceTransportEventNotifierRustAdapter;
+        fn notify(self: &DtlsIceTransportEventNotifierRustAdapter);
+
+        type TeardownCompletionRustAdapter;
+        fn complete(self: &mut TeardownCompletionRustAdapter);
+
+        type RtpPacketListenerRustAdapter;
+        fn on_rtp(self: &mut RtpPacketListenerRustAdapter, packet: &RtpPacketFacade);
+
+        type MediaFrameListenerRustAdapter;
+        fn on_media_frame(self: &mut MediaFrameListenerRustAdapter, frame: &MediaFrameFacade);
     }
 
     unsafe extern "C++" {
@@ -55,32 +179,128 @@ mod ffi {
 
         fn openssl_class_init() -> Result<()>;
 
-        fn dtls_connection_initialize() -> Result<()>;
+        fn dtls_connection_set_certificate(cert_path: &str, key_path: &str);
+        fn dtls_connection_ensure_certificate(
+            cert_path: &str,
+            key_path: &str,
+            key_type: DtlsCertificateKeyType,
+        ) -> Result<()>;
+        fn dtls_connection_initialize(key_type: DtlsCertificateKeyType) -> Result<()>;
+        fn dtls_certificate_handshake_benchmark(key_type: DtlsCertificateKeyType, handshakes: usize) -> Result<u64>;
         fn dtls_connection_get_certificate_fingerprint(hash: DtlsConnectionHash) -> Result<String>;
 
         fn rtp_transport_set_port_range(min: u16, max: u16) -> Result<()>;
 
+        fn srtp_benchmark(
+            profile: SrtpProtectionProfile,
+            payload_size: usize,
+            packets: usize,
+        ) -> Result<SrtpBenchmarkResult>;
+
+        fn teardown_flush(completion: Box<TeardownCompletionRustAdapter>);
+
         type PropertiesFacade;
         fn new_properties() -> UniquePtr<PropertiesFacade>;
         fn set_int(self: Pin<&mut PropertiesFacade>, key: &str, value: i32);
         fn set_bool(self: Pin<&mut PropertiesFacade>, key: &str, value: bool);
         fn set_string(self: Pin<&mut PropertiesFacade>, key: &str, value: &str);
+        fn get_int(self: &PropertiesFacade, key: &str) -> Result<i32>;
+        fn get_bool(self: &PropertiesFacade, key: &str) -> Result<bool>;
+        fn get_string(self: &PropertiesFacade, key: &str) -> Result<String>;
+        fn new_ice_transport_properties<'a>(parameters: &IceTransportParameters<'a>) -> UniquePtr<PropertiesFacade>;
+        fn new_rtp_properties<'a>(
+            audio: &RtpMediaParameters<'a>,
+            video: &RtpMediaParameters<'a>,
+        ) -> UniquePtr<PropertiesFacade>;
+
+        type DtlsIceTransportEventQueueFacade;
+        fn pop_event(self: Pin<&mut DtlsIceTransportEventQueueFacade>, event: &mut DtlsIceTransportEvent) -> bool;
+        fn is_closed(self: &DtlsIceTransportEventQueueFacade) -> bool;
+        fn get_stats(self: &DtlsIceTransportEventQueueFacade) -> DtlsIceTransportEventQueueStats;
+
+        type RtpPacketFacade;
+        fn get_ssrc(self: &RtpPacketFacade) -> u32;
+        fn get_sequence_number(self: &RtpPacketFacade) -> u16;
+        fn get_timestamp(self: &RtpPacketFacade) -> u32;
+        fn get_payload_type(self: &RtpPacketFacade) -> u8;
+        fn get_marker(self: &RtpPacketFacade) -> bool;
+        fn is_key_frame(self: &RtpPacketFacade) -> bool;
+        fn get_payload(self: &RtpPacketFacade) -> &[u8];
+        fn retain(self: &RtpPacketFacade) -> UniquePtr<RtpPacketFacade>;
+
+        type RtpPacketTapFacade;
+
+        type MediaFrameFacade;
+        fn get_type(self: &MediaFrameFacade) -> MediaFrameType;
+        fn get_timestamp(self: &MediaFrameFacade) -> u64;
+        fn get_clock_rate(self: &MediaFrameFacade) -> u32;
+        fn is_intra(self: &MediaFrameFacade) -> bool;
+        fn get_data(self: &MediaFrameFacade) -> &[u8];
+        fn retain(self: &MediaFrameFacade) -> UniquePtr<MediaFrameFacade>;
+
+        type MediaFrameTapFacade;
 
         type RtpIncomingSourceGroupFacade;
+        fn add_packet_listener(
+            self: Pin<&mut RtpIncomingSourceGroupFacade>,
+            listener: Box<RtpPacketListenerRustAdapter>,
+        ) -> UniquePtr<RtpPacketTapFacade>;
+        fn add_media_frame_listener(
+            self: Pin<&mut RtpIncomingSourceGroupFacade>,
+            listener: Box<MediaFrameListenerRustAdapter>,
+        ) -> UniquePtr<MediaFrameTapFacade>;
+        fn enable_keyframe_cache(self: Pin<&mut RtpIncomingSourceGroupFacade>, max_packets: usize);
+        fn set_keyframe_request_interval(self: Pin<&mut RtpIncomingSourceGroupFacade>, min_interval_ms: u32);
+        fn get_keyframe_request_stats(self: &RtpIncomingSourceGroupFacade) -> KeyframeRequestStats;
 
         type RtpOutgoingSourceGroupFacade;
         fn add_transponder(self: Pin<&mut RtpOutgoingSourceGroupFacade>) -> UniquePtr<RtpStreamTransponderFacade>;
 
         type RtpStreamTransponderFacade;
         fn set_incoming(self: Pin<&mut RtpStreamTransponderFacade>, incoming: Pin<&mut RtpIncomingSourceGroupFacade>);
+        fn set_incoming_on_keyframe(
+            self: Pin<&mut RtpStreamTransponderFacade>,
+            incoming: Pin<&mut RtpIncomingSourceGroupFacade>,
+        );
+        fn get_switch_stats(self: &RtpStreamTransponderFacade) -> RtpStreamTransponderSwitchStats;
+        fn select_layer(self: Pin<&mut RtpStreamTransponderFacade>, spatial_layer_id: u8, temporal_layer_id: u8);
+        fn set_maximum_layers(
+            self: Pin<&mut RtpStreamTransponderFacade>,
+            max_spatial_layer_id: u8,
+            max_temporal_layer_id: u8,
+        );
+        fn get_current_layers(self: &RtpStreamTransponderFacade) -> RtpLayerSelection;
+
+        type RtpSourceGroupBatchFacade;
+        fn get_incoming_count(self: &RtpSourceGroupBatchFacade) -> usize;
+        fn get_outgoing_count(self: &RtpSourceGroupBatchFacade) -> usize;
+        fn take_incoming(
+            self: Pin<&mut RtpSourceGroupBatchFacade>,
+            index: usize,
+        ) -> Result<UniquePtr<RtpIncomingSourceGroupFacade>>;
+        fn take_outgoing(
+            self: Pin<&mut RtpSourceGroupBatchFacade>,
+            index: usize,
+        ) -> Result<UniquePtr<RtpOutgoingSourceGroupFacade>>;
 
         type RtpBundleTransportConnectionFacade;
-        fn set_listener(
+        fn set_event_queue(
             self: Pin<&mut RtpBundleTransportConnectionFacade>,
-            listener: Box<DtlsIceTransportListenerRustAdapter>,
-        );
+            capacity: usize,
+            notifier: Box<DtlsIceTransportEventNotifierRustAdapter>,
+        ) -> UniquePtr<DtlsIceTransportEventQueueFacade>;
         fn set_remote_properties(self: Pin<&mut RtpBundleTransportConnectionFacade>, properties: &PropertiesFacade);
         fn set_local_properties(self: Pin<&mut RtpBundleTransportConnectionFacade>, properties: &PropertiesFacade);
+        fn set_remote_rtp_parameters<'a>(
+            self: Pin<&mut RtpBundleTransportConnectionFacade>,
+            audio: &RtpMediaParameters<'a>,
+            video: &RtpMediaParameters<'a>,
+        );
+        fn set_local_rtp_parameters<'a>(
+            self: Pin<&mut RtpBundleTransportConnectionFacade>,
+            audio: &RtpMediaParameters<'a>,
+            video: &RtpMediaParameters<'a>,
+        );
         fn add_incoming_source_group(
             self: Pin<&mut RtpBundleTransportConnectionFacade>,
             kind: MediaFrameType,
@@ -96,16 +316,45 @@ mod ffi {
             media_ssrc: u32,
             rtx_ssrc: u32,
         ) -> Result<UniquePtr<RtpOutgoingSourceGroupFacade>>;
+        fn add_source_groups<'a>(
+            self: Pin<&mut RtpBundleTransportConnectionFacade>,
+            incoming: &[RtpIncomingSourceGroupParameters<'a>],
+            outgoing: &[RtpOutgoingSourceGroupParameters<'a>],
+        ) -> Result<UniquePtr<RtpSourceGroupBatchFacade>>;
         fn add_remote_candidate(self: Pin<&mut RtpBundleTransportConnectionFacade>, ip: &str, port: u16);
 
         type RtpBundleTransportFacade;
         fn new_rtp_bundle_transport(port: u16) -> Result<UniquePtr<RtpBundleTransportFacade>>;
         fn get_local_port(self: &RtpBundleTransportFacade) -> u16;
+        fn get_connection_count(self: &RtpBundleTransportFacade) -> usize;
+        fn set_affinity(self: Pin<&mut RtpBundleTransportFacade>, cpu: i32) -> bool;
         fn add_ice_transport(
             self: Pin<&mut RtpBundleTransportFacade>,
             username: &str,
             properties: &PropertiesFacade,
         ) -> Result<UniquePtr<RtpBundleTransportConnectionFacade>>;
+        fn add_ice_transport_with_parameters<'a>(
+            self: Pin<&mut RtpBundleTransportFacade>,
+            username: &str,
+            parameters: &IceTransportParameters<'a>,
+        ) -> Result<UniquePtr<RtpBundleTransportConnectionFacade>>;
+
+        type RtpBundleTransportPoolFacade;
+        fn new_rtp_bundle_transport_pool(shard_count: usize) -> Result<UniquePtr<RtpBundleTransportPoolFacade>>;
+        fn get_shard_count(self: &RtpBundleTransportPoolFacade) -> usize;
+        fn get_shard_for_username(self: &RtpBundleTransportPoolFacade, username: &str) -> usize;
+        fn get_shard_local_port(self: &RtpBundleTransportPoolFacade, shard: usize) -> Result<u16>;
+        fn get_shard_stats(self: &RtpBundleTransportPoolFacade) -> Vec<RtpBundleTransportShardStats>;
+        fn add_ice_transport(
+            self: &RtpBundleTransportPoolFacade,
+            username: &str,
+            properties: &PropertiesFacade,
+        ) -> Result<UniquePtr<RtpBundleTransportConnectionFacade>>;
+        fn add_ice_transport_with_parameters<'a>(
+            self: &RtpBundleTransportPoolFacade,
+            username: &str,
+            parameters: &IceTransportParameters<'a>,
+        ) -> Result<UniquePtr<RtpBundleTransportConnectionFacade>>;
     }
 }
 
@@ -113,11 +362,28 @@ pub use cxx::UniquePtr;
 pub use ffi::*;
 
 unsafe impl Send for PropertiesFacade {}
+unsafe impl Send for DtlsIceTransportEventQueueFacade {}
+unsafe impl Send for RtpPacketFacade {}
+unsafe impl Sync for RtpPacketFacade {}
+unsafe impl Send for RtpPacketTapFacade {}
+unsafe impl Send for MediaFrameFacade {}
+unsafe impl Sync for MediaFrameFacade {}
+unsafe impl Send for MediaFrameTapFacade {}
 unsafe impl Send for RtpIncomingSourceGroupFacade {}
 unsafe impl Send for RtpOutgoingSourceGroupFacade {}
 unsafe impl Send for RtpStreamTransponderFacade {}
+unsafe impl Send for RtpSourceGroupBatchFacade {}
 unsafe impl Send for RtpBundleTransportConnectionFacade {}
 unsafe impl Send for RtpBundleTransportFacade {}
+unsafe impl Send for RtpBundleTransportPoolFacade {}
+unsafe impl Sync for RtpBundleTransportPoolFacade {}
+
+impl RtpLayerSelection {
+    pub const ALL: Self = Self {
+        spatial_layer_id: 255,
+        temporal_layer_id: 255,
+    };
+}
 
 impl std::fmt::Debug for DtlsIceTransportDtlsState {
     fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
@@ -132,32 +398,109 @@ impl std::fmt::Debug for DtlsIceTransportDtlsState {
     }
 }
 
-#[allow(unused_variables)]
-pub trait DtlsIceTransportListener: Send {
-    fn on_ice_timeout(&mut self) {}
-    fn on_dtls_state_changed(&mut self, state: DtlsIceTransportDtlsState) {}
-    fn on_remote_ice_candidate_activated(&mut self, ip: &str, port: u16, priority: u32) {}
+impl Default for DtlsIceTransportEvent {
+    fn default() -> Self {
+        Self {
+            kind: DtlsIceTransportEventKind::IceTimeout,
+            dtls_state: DtlsIceTransportDtlsState::New,
+            ip: String::new(),
+            port: 0,
+            priority: 0,
+        }
+    }
 }
 
-pub struct DtlsIceTransportListenerRustAdapter(Box<dyn DtlsIceTransportListener>);
+/// Called from the media event loop thread whenever a new event has been queued.
+///
+/// This needs to be very cheap and must never block, the event itself should be read from the
+/// queue on another thread.
+pub trait DtlsIceTransportEventNotifier: Send + Sync {
+    fn notify(&self);
+}
+
+pub struct DtlsIceTransportEventNotifierRustAdapter(Box<dyn DtlsIceTransportEventNotifier>);
 
-impl DtlsIceTransportListenerRustAdapter {
-    fn on_ice_timeout(&mut self) {
-        self.0.on_ice_timeout()
+impl DtlsIceTransportEventNotifierRustAdapter {
+    fn notify(&self) {
+        self.0.notify()
     }
+}
 
-    fn on_dtls_state_changed(&mut self, state: DtlsIceTransportDtlsState) {
-        self.0.on_dtls_state_changed(state)
+impl<T> From<T> for DtlsIceTransportEventNotifierRustAdapter
+where
+    T: 'static + DtlsIceTransportEventNotifier,
+{
+    fn from(notifier: T) -> Self {
+        Self(Box::new(notifier))
     }
+}
+
+/// Called from the bridge's teardown thread once everything released before the matching
+/// `teardown_flush` call has been destroyed.
+pub struct TeardownCompletionRustAdapter(Option<Box<dyn FnOnce() + Send>>);
+
+impl TeardownCompletionRustAdapter {
+    fn complete(&mut self) {
+        if let Some(completion) = self.0.take() {
+            completion()
+        }
+    }
+}
+
+impl<T> From<T> for TeardownCompletionRustAdapter
+where
+    T: 'static + FnOnce() + Send,
+{
+    fn from(completion: T) -> Self {
+        Self(Some(Box::new(completion)))
+    }
+}
+
+/// Called on the media event loop thread for every packet received by a source group.
+///
+/// This holds up all other processing on the transport, so anything non-trivial should `retain`
+/// the packet (which only bumps a reference count) and hand it off to another thread.
+pub trait RtpPacketListener: Send {
+    fn on_rtp(&mut self, packet: &RtpPacketFacade);
+}
+
+pub struct RtpPacketListenerRustAdapter(Box<dyn RtpPacketListener>);
+
+impl RtpPacketListenerRustAdapter {
+    fn on_rtp(&mut self, packet: &RtpPacketFacade) {
+        self.0.on_rtp(packet)
+    }
+}
+
+impl<T> From<T> for RtpPacketListenerRustAdapter
+where
+    T: 'static + RtpPacketListener,
+{
+    fn from(listener: T) -> Self {
+        Self(Box::new(listener))
+    }
+}
+
+/// Called on the media event loop thread for every frame reassembled from a source group's packets.
+///
+/// The frame data is only borrowed for the duration of the call, `retain` copies it into a buffer
+/// drawn from a pool owned by the stream, and the retained facade itself is recycled through a
+/// free list, so steady-state retention does not allocate.
+pub trait MediaFrameListener: Send {
+    fn on_media_frame(&mut self, frame: &MediaFrameFacade);
+}
+
+pub struct MediaFrameListenerRustAdapter(Box<dyn MediaFrameListener>);
 
-    fn on_remote_ice_candidate_activated(&mut self, ip: &str, port: u16, priority: u32) {
-        self.0.on_remote_ice_candidate_activated(ip, port, priority)
+impl MediaFrameListenerRustAdapter {
+    fn on_media_frame(&mut self, frame: &MediaFrameFacade) {
+        self.0.on_media_frame(frame)
     }
 }
 
-impl<T> From<T> for DtlsIceTransportListenerRustAdapter
+impl<T> From<T> for MediaFrameListenerRustAdapter
 where
-    T: 'static + DtlsIceTransportListener,
+    T: 'static + MediaFrameListener,
 {
     fn from(listener: T) -> Self {
         Self(Box::new(listener))
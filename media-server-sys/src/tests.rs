@@ -1,9 +1,11 @@
 #![cfg(test)]
 
 use super::*;
-use futures::channel::oneshot;
+use futures::channel::mpsc;
 use futures::future::Either;
+use futures::stream::StreamExt;
 use parking_lot::{const_mutex, Mutex};
+use std::pin::Pin;
 
 static INIT_MUTEX: Mutex<bool> = const_mutex(false);
 
@@ -22,7 +24,7 @@ fn library_init() -> Result<(), Box<dyn std::error::Error>> {
 
     openssl_class_init()?;
 
-    dtls_connection_initialize()?;
+    dtls_connection_initialize(DtlsCertificateKeyType::EcdsaP256)?;
 
     Ok(())
 }
@@ -45,6 +47,26 @@ fn create_transport() {
     println!("Port: {:?}", port);
 }
 
+#[test]
+fn create_transport_pool() {
+    library_init().unwrap();
+
+    let pool = new_rtp_bundle_transport_pool(2).unwrap();
+    assert_eq!(pool.get_shard_count(), 2);
+
+    let shard = pool.get_shard_for_username("one:two");
+    assert!(shard < 2);
+    assert_eq!(shard, pool.get_shard_for_username("one:two"));
+
+    let stats = pool.get_shard_stats();
+    println!("Stats: {:?}", stats);
+    assert_eq!(stats.len(), 2);
+    assert_eq!(stats[shard].local_port, pool.get_shard_local_port(shard).unwrap());
+    assert!(stats.iter().all(|shard| shard.connection_count == 0));
+
+    assert!(pool.get_shard_local_port(2).is_err());
+}
+
 #[test]
 fn create_connection_failure() {
     library_init().unwrap();
@@ -57,6 +79,323 @@ fn create_connection_failure() {
     assert!(connection_result.is_err());
 }
 
+#[test]
+fn create_connection_with_parameters() {
+    library_init().unwrap();
+
+    let fingerprint = dtls_connection_get_certificate_fingerprint(DtlsConnectionHash::SHA256).unwrap();
+
+    let mut transport = new_rtp_bundle_transport(0).unwrap();
+
+    let parameters = IceTransportParameters {
+        local_username: "one",
+        local_password: "one",
+        remote_username: "two",
+        remote_password: "two",
+        dtls_setup: "passive",
+        dtls_hash: "SHA-256",
+        dtls_fingerprint: &fingerprint,
+        disable_stun_keep_alive: true,
+        srtp_protection_profiles: &[],
+    };
+
+    let properties = new_ice_transport_properties(&parameters);
+    assert_eq!(properties.get_string("ice.localUsername").unwrap(), "one");
+    assert_eq!(properties.get_string("ice.remotePassword").unwrap(), "two");
+    assert_eq!(properties.get_string("dtls.setup").unwrap(), "passive");
+    assert_eq!(properties.get_string("dtls.hash").unwrap(), "SHA-256");
+    assert_eq!(properties.get_string("dtls.fingerprint").unwrap(), fingerprint);
+    assert!(properties.get_bool("disableSTUNKeepAlive").unwrap());
+    assert_eq!(
+        properties.get_string("srtpProtectionProfiles").unwrap(),
+        "SRTP_AEAD_AES_128_GCM:SRTP_AES128_CM_SHA1_80"
+    );
+
+    let mut connection = transport
+        .pin_mut()
+        .add_ice_transport_with_parameters("one:two", &parameters)
+        .unwrap();
+
+    let audio_codecs = [RtpCodecParameters {
+        name: "opus",
+        payload_type: 111,
+        rtx_payload_type: 0,
+    }];
+    let video_codecs = [RtpCodecParameters {
+        name: "vp8",
+        payload_type: 96,
+        rtx_payload_type: 97,
+    }];
+    let extensions = [RtpExtensionParameters {
+        id: 4,
+        uri: "urn:ietf:params:rtp-hdrext:sdes:mid",
+    }];
+
+    let audio = RtpMediaParameters {
+        codecs: &audio_codecs,
+        extensions: &extensions,
+    };
+    let video = RtpMediaParameters {
+        codecs: &video_codecs,
+        extensions: &extensions,
+    };
+
+    let properties = new_rtp_properties(&audio, &video);
+    assert_eq!(properties.get_int("audio.codecs.length").unwrap(), 1);
+    assert_eq!(properties.get_string("audio.codecs.0.codec").unwrap(), "opus");
+    assert_eq!(properties.get_int("audio.codecs.0.pt").unwrap(), 111);
+    assert!(properties.get_int("audio.codecs.0.rtx").is_err());
+    assert_eq!(properties.get_string("video.codecs.0.codec").unwrap(), "vp8");
+    assert_eq!(properties.get_int("video.codecs.0.pt").unwrap(), 96);
+    assert_eq!(properties.get_int("video.codecs.0.rtx").unwrap(), 97);
+    assert_eq!(properties.get_int("video.ext.length").unwrap(), 1);
+    assert_eq!(properties.get_int("video.ext.0.id").unwrap(), 4);
+    assert_eq!(
+        properties.get_string("video.ext.0.uri").unwrap(),
+        "urn:ietf:params:rtp-hdrext:sdes:mid"
+    );
+
+    connection.pin_mut().set_remote_rtp_parameters(&audio, &video);
+    connection.pin_mut().set_local_rtp_parameters(&audio, &video);
+
+    assert_eq!(transport.get_connection_count(), 1);
+}
+
+fn add_test_connection(transport: Pin<&mut RtpBundleTransportFacade>) -> UniquePtr<RtpBundleTransportConnectionFacade> {
+    let fingerprint = dtls_connection_get_certificate_fingerprint(DtlsConnectionHash::SHA256).unwrap();
+
+    let mut properties = new_properties();
+    properties.pin_mut().set_string("ice.localUsername", "one");
+    properties.pin_mut().set_string("ice.localPassword", "one");
+    properties.pin_mut().set_string("ice.remoteUsername", "two");
+    properties.pin_mut().set_string("ice.remotePassword", "two");
+    properties.pin_mut().set_string("dtls.setup", "passive");
+    properties.pin_mut().set_string("dtls.hash", "SHA-256");
+    properties.pin_mut().set_string("dtls.fingerprint", &fingerprint);
+    properties.pin_mut().set_bool("disableSTUNKeepAlive", true);
+    properties.pin_mut().set_string("srtpProtectionProfiles", "");
+
+    transport.add_ice_transport("one:two", &properties).unwrap()
+}
+
+#[test]
+fn add_source_groups() {
+    library_init().unwrap();
+
+    let mut transport = new_rtp_bundle_transport(0).unwrap();
+    let mut connection = add_test_connection(transport.pin_mut());
+
+    let incoming = [
+        RtpIncomingSourceGroupParameters {
+            kind: MediaFrameType::Audio,
+            mid: "0",
+            rid: "",
+            media_ssrc: 1000,
+            rtx_ssrc: 1001,
+        },
+        RtpIncomingSourceGroupParameters {
+            kind: MediaFrameType::Video,
+            mid: "1",
+            rid: "",
+            media_ssrc: 2000,
+            rtx_ssrc: 2001,
+        },
+    ];
+    let outgoing = [RtpOutgoingSourceGroupParameters {
+        kind: MediaFrameType::Video,
+        mid: "1",
+        media_ssrc: 3000,
+        rtx_ssrc: 3001,
+    }];
+
+    let mut batch = connection.pin_mut().add_source_groups(&incoming, &outgoing).unwrap();
+    assert_eq!(batch.get_incoming_count(), 2);
+    assert_eq!(batch.get_outgoing_count(), 1);
+
+    for i in 0..2 {
+        assert!(batch.pin_mut().take_incoming(i).is_ok());
+        assert!(batch.pin_mut().take_incoming(i).is_err());
+    }
+    assert!(batch.pin_mut().take_incoming(2).is_err());
+
+    assert!(batch.pin_mut().take_outgoing(0).is_ok());
+    assert!(batch.pin_mut().take_outgoing(0).is_err());
+
+    // The second outgoing group reuses an SSRC, so the whole batch has to be rolled back.
+    let incoming = [
+        RtpIncomingSourceGroupParameters {
+            kind: MediaFrameType::Audio,
+            mid: "2",
+            rid: "",
+            media_ssrc: 4000,
+            rtx_ssrc: 4001,
+        },
+        RtpIncomingSourceGroupParameters {
+            kind: MediaFrameType::Video,
+            mid: "3",
+            rid: "",
+            media_ssrc: 5000,
+            rtx_ssrc: 5001,
+        },
+    ];
+    let outgoing = [
+        RtpOutgoingSourceGroupParameters {
+            kind: MediaFrameType::Video,
+            mid: "3",
+            media_ssrc: 6000,
+            rtx_ssrc: 6001,
+        },
+        RtpOutgoingSourceGroupParameters {
+            kind: MediaFrameType::Video,
+            mid: "4",
+            media_ssrc: 6000,
+            rtx_ssrc: 6002,
+        },
+    ];
+
+    assert!(connection.pin_mut().add_source_groups(&incoming, &outgoing).is_err());
+
+    // None of the groups were left installed, so their SSRCs can all be added again.
+    let _incoming_one = connection
+        .pin_mut()
+        .add_incoming_source_group(MediaFrameType::Audio, "2", "", 4000, 4001)
+        .unwrap();
+    let _incoming_two = connection
+        .pin_mut()
+        .add_incoming_source_group(MediaFrameType::Video, "3", "", 5000, 5001)
+        .unwrap();
+    let _outgoing = connection
+        .pin_mut()
+        .add_outgoing_source_group(MediaFrameType::Video, "3", 6000, 6001)
+        .unwrap();
+}
+
+#[test]
+fn keyframe_request_aggregation() {
+    library_init().unwrap();
+
+    let mut transport = new_rtp_bundle_transport(0).unwrap();
+    let mut connection = add_test_connection(transport.pin_mut());
+
+    let mut incoming_one = connection
+        .pin_mut()
+        .add_incoming_source_group(MediaFrameType::Video, "0", "", 1000, 1001)
+        .unwrap();
+    let mut incoming_two = connection
+        .pin_mut()
+        .add_incoming_source_group(MediaFrameType::Video, "1", "", 2000, 2001)
+        .unwrap();
+    let mut outgoing = connection
+        .pin_mut()
+        .add_outgoing_source_group(MediaFrameType::Video, "0", 1, 2)
+        .unwrap();
+    let mut transponder = outgoing.pin_mut().add_transponder();
+
+    transponder.pin_mut().set_incoming(incoming_one.pin_mut());
+
+    // Every keyframe-aligned switch asks the new source for a keyframe through its aggregator,
+    // back to back requests land well inside the default interval.
+    let before = incoming_two.get_keyframe_request_stats();
+    for _ in 0..5 {
+        transponder.pin_mut().set_incoming_on_keyframe(incoming_two.pin_mut());
+    }
+    let after = incoming_two.get_keyframe_request_stats();
+    println!("Stats: {:?}", after);
+
+    assert!(after.received >= before.received + 5);
+    assert!(after.forwarded - before.forwarded <= 1);
+    assert!(after.suppressed - before.suppressed >= 4);
+
+    // The suppressed requests are answered by one trailing request once the interval is over.
+    std::thread::sleep(std::time::Duration::from_millis(750));
+
+    let before = after;
+    let after = incoming_two.get_keyframe_request_stats();
+    println!("Stats: {:?}", after);
+
+    assert_eq!(after.received, before.received);
+    assert_eq!(after.forwarded, before.forwarded + 1);
+
+    // Without an interval every request reaches the publisher.
+    incoming_two.pin_mut().set_keyframe_request_interval(0);
+
+    let before = after;
+    for _ in 0..3 {
+        transponder.pin_mut().set_incoming_on_keyframe(incoming_two.pin_mut());
+    }
+    let after = incoming_two.get_keyframe_request_stats();
+    println!("Stats: {:?}", after);
+
+    assert!(after.forwarded - before.forwarded >= 3);
+    assert_eq!(after.suppressed, before.suppressed);
+}
+
+#[test]
+fn transponder_keyframe_switch() {
+    library_init().unwrap();
+
+    let mut transport = new_rtp_bundle_transport(0).unwrap();
+    let mut connection = add_test_connection(transport.pin_mut());
+
+    let mut incoming_one = connection
+        .pin_mut()
+        .add_incoming_source_group(MediaFrameType::Video, "0", "", 1000, 1001)
+        .unwrap();
+    let mut incoming_two = connection
+        .pin_mut()
+        .add_incoming_source_group(MediaFrameType::Video, "1", "", 2000, 2001)
+        .unwrap();
+    let mut outgoing = connection
+        .pin_mut()
+        .add_outgoing_source_group(MediaFrameType::Video, "0", 1, 2)
+        .unwrap();
+    let mut transponder = outgoing.pin_mut().add_transponder();
+
+    // With nothing forwarded yet there is nothing to keep going, so the switch happens right away.
+    transponder.pin_mut().set_incoming_on_keyframe(incoming_one.pin_mut());
+    assert!(!transponder.get_switch_stats().pending);
+
+    // No packets ever arrive, so the switch waits for a keyframe until it is cancelled.
+    transponder.pin_mut().set_incoming_on_keyframe(incoming_two.pin_mut());
+    let stats = transponder.get_switch_stats();
+    println!("Stats: {:?}", stats);
+    assert!(stats.pending);
+
+    transponder.pin_mut().set_incoming(incoming_one.pin_mut());
+    let stats = transponder.get_switch_stats();
+    println!("Stats: {:?}", stats);
+    assert!(!stats.pending);
+    assert_eq!(stats.switch_count, 0);
+}
+
+#[test]
+fn transponder_layer_selection() {
+    library_init().unwrap();
+
+    let mut transport = new_rtp_bundle_transport(0).unwrap();
+    let mut connection = add_test_connection(transport.pin_mut());
+
+    let mut incoming = connection
+        .pin_mut()
+        .add_incoming_source_group(MediaFrameType::Video, "0", "", 1000, 1001)
+        .unwrap();
+    let mut outgoing = connection
+        .pin_mut()
+        .add_outgoing_source_group(MediaFrameType::Video, "0", 1, 2)
+        .unwrap();
+    let mut transponder = outgoing.pin_mut().add_transponder();
+
+    assert_eq!(transponder.get_current_layers(), RtpLayerSelection::ALL);
+
+    // The current layers are the ones being forwarded, a selection only takes effect on the packets
+    // that follow it, and none ever arrive here.
+    transponder.pin_mut().set_incoming(incoming.pin_mut());
+    transponder.pin_mut().select_layer(0, 0);
+    transponder.pin_mut().set_maximum_layers(1, 1);
+
+    assert_eq!(transponder.get_current_layers(), RtpLayerSelection::ALL);
+}
+
 #[test]
 fn transport_connection() {
     library_init().unwrap();
@@ -81,34 +420,45 @@ fn transport_connection() {
         .add_ice_transport("one:two", &properties_one)
         .unwrap();
 
-    struct LoggingDtlsIceTransportListener(&'static str, Option<oneshot::Sender<()>>);
+    struct ChannelDtlsIceTransportEventNotifier(mpsc::UnboundedSender<()>);
 
-    impl DtlsIceTransportListener for LoggingDtlsIceTransportListener {
-        fn on_ice_timeout(&mut self) {
-            println!("{}.on_ice_timeout()", self.0);
+    impl DtlsIceTransportEventNotifier for ChannelDtlsIceTransportEventNotifier {
+        fn notify(&self) {
+            let _ = self.0.unbounded_send(());
         }
+    }
 
-        fn on_dtls_state_changed(&mut self, state: DtlsIceTransportDtlsState) {
-            println!("{}.on_dtls_state_changed(state: {:?})", self.0, state);
-
-            if state == DtlsIceTransportDtlsState::Connected {
-                self.1.take().unwrap().send(()).unwrap();
+    async fn wait_for_connected(
+        name: &'static str,
+        mut queue: UniquePtr<DtlsIceTransportEventQueueFacade>,
+        mut notifications: mpsc::UnboundedReceiver<()>,
+    ) -> Result<(), &'static str> {
+        let mut event = DtlsIceTransportEvent::default();
+
+        while notifications.next().await.is_some() {
+            while queue.pin_mut().pop_event(&mut event) {
+                println!("{}: {:?}", name, event);
+
+                if event.kind == DtlsIceTransportEventKind::DtlsStateChanged
+                    && event.dtls_state == DtlsIceTransportDtlsState::Connected
+                {
+                    let stats = queue.get_stats();
+                    println!("{}: {:?}", name, stats);
+                    assert_eq!(stats.dropped, 0);
+
+                    return Ok(());
+                }
             }
         }
 
-        fn on_remote_ice_candidate_activated(&mut self, ip: &str, port: u16, priority: u32) {
-            println!(
-                "{}.on_remote_ice_candidate_activated(ip: {:?}, port: {:?}, priority: {:?})",
-                self.0, ip, port, priority
-            );
-        }
+        Err("notifier dropped")
     }
 
-    let (sender_one, receiver_one) = oneshot::channel();
-    let listener_one = Box::new(DtlsIceTransportListenerRustAdapter::from(
-        LoggingDtlsIceTransportListener("one", Some(sender_one)),
+    let (sender_one, receiver_one) = mpsc::unbounded();
+    let notifier_one = Box::new(DtlsIceTransportEventNotifierRustAdapter::from(
+        ChannelDtlsIceTransportEventNotifier(sender_one),
     ));
-    connection_one.pin_mut().set_listener(listener_one);
+    let queue_one = connection_one.pin_mut().set_event_queue(16, notifier_one);
 
     let mut transport_two = new_rtp_bundle_transport(0).unwrap();
 
@@ -128,23 +478,26 @@ fn transport_connection() {
         .add_ice_transport("two:one", &properties_two)
         .unwrap();
 
-    let (sender_two, receiver_two) = oneshot::channel();
-    let listener_two = Box::new(DtlsIceTransportListenerRustAdapter::from(
-        LoggingDtlsIceTransportListener("two", Some(sender_two)),
+    let (sender_two, receiver_two) = mpsc::unbounded();
+    let notifier_two = Box::new(DtlsIceTransportEventNotifierRustAdapter::from(
+        ChannelDtlsIceTransportEventNotifier(sender_two),
     ));
-    connection_two.pin_mut().set_listener(listener_two);
+    let queue_two = connection_two.pin_mut().set_event_queue(16, notifier_two);
 
     connection_two
         .pin_mut()
         .add_remote_candidate("127.0.0.1", transport_one.get_local_port());
 
     futures::executor::block_on(async {
-        let connected = futures::future::try_join(receiver_one, receiver_two);
+        let connected = futures::future::try_join(
+            wait_for_connected("one", queue_one, receiver_one),
+            wait_for_connected("two", queue_two, receiver_two),
+        );
         let timeout = futures_timer::Delay::new(std::time::Duration::from_secs(10));
 
-        match futures::future::select(connected, timeout).await {
+        match futures::future::select(Box::pin(connected), timeout).await {
             Either::Left((Ok(_), _)) => println!("connection established"),
-            Either::Left((Err(err), _)) => panic!("failed to read from channel: {:?}", err),
+            Either::Left((Err(err), _)) => panic!("failed to wait for connection: {:?}", err),
             Either::Right(_) => panic!("connection was not established in time"),
         }
     });
@@ -0,0 +1,22 @@
+//! Compares how many handshakes per second a single core can complete with an ECDSA P-256 and an
+//! RSA-2048 DTLS certificate.
+//!
+//! Both ends of each handshake run on the same thread, so the server's share is somewhat less than
+//! the total, but the signing cost that dominates join storms shows up all the same.
+
+use media_server::{DtlsCertificateKeyType, LoggingLevel, Result};
+
+const HANDSHAKES: usize = 2000;
+
+const KEY_TYPES: &[DtlsCertificateKeyType] = &[DtlsCertificateKeyType::EcdsaP256, DtlsCertificateKeyType::Rsa2048];
+
+fn main() -> Result<()> {
+    media_server::library_init(LoggingLevel::None, DtlsCertificateKeyType::EcdsaP256)?;
+
+    for &key_type in KEY_TYPES {
+        let rate = media_server::measure_dtls_handshake_rate(key_type, HANDSHAKES)?;
+        println!("{:?}: {:.0} handshakes/s", key_type, rate);
+    }
+
+    Ok(())
+}
@@ -0,0 +1,187 @@
+//! Times the native part of handling an offer (creating the connection and its source groups) for
+//! a burst of joins, adding source groups one at a time and then with a single batched call.
+//!
+//! Each join looks like a Chrome simulcast offer: audio plus video with three RIDs, with the audio
+//! and the first video encoding sent back out.
+
+use std::time::{Duration, Instant};
+
+use media_server::{
+    DtlsCertificateKeyType, DtlsConnectionHash, LoggingLevel, MediaFrameType, Properties, Result, RtpBundleTransport,
+    RtpBundleTransportConnection, RtpIncomingSourceGroup, RtpIncomingSourceGroupParameters, RtpOutgoingSourceGroup,
+    RtpOutgoingSourceGroupParameters,
+};
+
+const JOINS: usize = 200;
+
+const INCOMING: &[RtpIncomingSourceGroupParameters] = &[
+    RtpIncomingSourceGroupParameters {
+        kind: MediaFrameType::Audio,
+        mid: "0",
+        rid: "",
+        media_ssrc: 1000,
+        rtx_ssrc: 0,
+    },
+    RtpIncomingSourceGroupParameters {
+        kind: MediaFrameType::Video,
+        mid: "1",
+        rid: "q",
+        media_ssrc: 0,
+        rtx_ssrc: 0,
+    },
+    RtpIncomingSourceGroupParameters {
+        kind: MediaFrameType::Video,
+        mid: "1",
+        rid: "h",
+        media_ssrc: 0,
+        rtx_ssrc: 0,
+    },
+    RtpIncomingSourceGroupParameters {
+        kind: MediaFrameType::Video,
+        mid: "1",
+        rid: "f",
+        media_ssrc: 0,
+        rtx_ssrc: 0,
+    },
+];
+
+const OUTGOING: &[RtpOutgoingSourceGroupParameters] = &[
+    RtpOutgoingSourceGroupParameters {
+        kind: MediaFrameType::Audio,
+        mid: "0",
+        media_ssrc: 2000,
+        rtx_ssrc: 0,
+    },
+    RtpOutgoingSourceGroupParameters {
+        kind: MediaFrameType::Video,
+        mid: "1",
+        media_ssrc: 3000,
+        rtx_ssrc: 3001,
+    },
+];
+
+struct Session {
+    _connection: RtpBundleTransportConnection,
+    _incoming: Vec<RtpIncomingSourceGroup>,
+    _outgoing: Vec<RtpOutgoingSourceGroup>,
+}
+
+fn add_connection(
+    transport: &mut RtpBundleTransport,
+    fingerprint: &str,
+    i: usize,
+) -> Result<RtpBundleTransportConnection> {
+    let local_username = format!("local{}", i);
+    let remote_username = format!("remote{}", i);
+
+    let mut properties = Properties::new();
+    properties.set_string("ice.localUsername", &local_username);
+    properties.set_string("ice.localPassword", "");
+    properties.set_string("ice.remoteUsername", &remote_username);
+    properties.set_string("ice.remotePassword", "");
+    properties.set_string("dtls.setup", "active");
+    properties.set_string("dtls.hash", "SHA-256");
+    properties.set_string("dtls.fingerprint", fingerprint);
+    properties.set_bool("disableSTUNKeepAlive", true);
+    properties.set_string("srtpProtectionProfiles", "");
+
+    let username = local_username + ":" + &remote_username;
+    transport.add_ice_transport(&username, &properties)
+}
+
+fn join_individually(
+    connection: &mut RtpBundleTransportConnection,
+) -> Result<(Vec<RtpIncomingSourceGroup>, Vec<RtpOutgoingSourceGroup>)> {
+    let mut incoming = Vec::new();
+    for parameters in INCOMING {
+        let rid = if parameters.rid.is_empty() {
+            None
+        } else {
+            Some(parameters.rid)
+        };
+        let media_ssrc = if parameters.media_ssrc == 0 {
+            None
+        } else {
+            Some(parameters.media_ssrc)
+        };
+        incoming.push(connection.add_incoming_source_group(
+            parameters.kind,
+            Some(parameters.mid),
+            rid,
+            media_ssrc,
+            None,
+        )?);
+    }
+
+    let mut outgoing = Vec::new();
+    for parameters in OUTGOING {
+        let rtx_ssrc = if parameters.rtx_ssrc == 0 {
+            None
+        } else {
+            Some(parameters.rtx_ssrc)
+        };
+        outgoing.push(connection.add_outgoing_source_group(
+            parameters.kind,
+            Some(parameters.mid),
+            parameters.media_ssrc,
+            rtx_ssrc,
+        )?);
+    }
+
+    Ok((incoming, outgoing))
+}
+
+fn run(name: &str, batched: bool) -> Result<()> {
+    let fingerprint = media_server::get_certificate_fingerprint(DtlsConnectionHash::Sha256)?;
+
+    let mut transport = RtpBundleTransport::new(None)?;
+    let mut sessions = Vec::with_capacity(JOINS);
+    let mut join_times = Vec::with_capacity(JOINS);
+
+    for i in 0..JOINS {
+        let start = Instant::now();
+
+        let mut connection = add_connection(&mut transport, &fingerprint, i)?;
+
+        let (incoming, outgoing) = if batched {
+            connection.add_source_groups(INCOMING, OUTGOING)?
+        } else {
+            join_individually(&mut connection)?
+        };
+
+        join_times.push(start.elapsed());
+
+        sessions.push(Session {
+            _connection: connection,
+            _incoming: incoming,
+            _outgoing: outgoing,
+        });
+    }
+
+    join_times.sort();
+    let total: Duration = join_times.iter().sum();
+
+    println!(
+        "{}: {} joins in {:?}, mean {:?}, p50 {:?}, p99 {:?}",
+        name,
+        JOINS,
+        total,
+        total / JOINS as u32,
+        join_times[JOINS / 2],
+        join_times[JOINS * 99 / 100],
+    );
+
+    drop(sessions);
+    futures::executor::block_on(transport.close());
+
+    Ok(())
+}
+
+fn main() -> Result<()> {
+    media_server::library_init(LoggingLevel::None, DtlsCertificateKeyType::EcdsaP256)?;
+
+    run("individual", false)?;
+    run("batched", true)?;
+
+    Ok(())
+}
@@ -1,31 +1,18 @@
 use std::time::Duration;
 
-use futures::channel::oneshot;
 use futures::future::Either;
+use futures::stream::StreamExt;
 use futures_timer::Delay;
 
 use media_server::{
-    DtlsConnectionHash, DtlsIceTransportDtlsState, DtlsIceTransportListener, LoggingLevel, Properties, Result,
-    RtpBundleTransport, RtpBundleTransportConnection,
+    DtlsCertificateKeyType, DtlsConnectionHash, DtlsIceTransportDtlsState, DtlsIceTransportEvent,
+    DtlsIceTransportEvents, LoggingLevel, Properties, Result, RtpBundleTransport, RtpBundleTransportConnection,
 };
 
-struct WaitForConnectionListener(Option<oneshot::Sender<()>>);
-
-impl DtlsIceTransportListener for WaitForConnectionListener {
-    fn on_dtls_state_changed(&mut self, state: DtlsIceTransportDtlsState) {
-        if state == DtlsIceTransportDtlsState::Connected {
-            // Ignore failure, panicking in here is an abort.
-            if let Some(sender) = self.0.take() {
-                let _ = sender.send(());
-            }
-        }
-    }
-}
-
 struct TestTransport {
     transport: RtpBundleTransport,
     connection: RtpBundleTransportConnection,
-    receiver: oneshot::Receiver<()>,
+    events: DtlsIceTransportEvents,
 }
 
 fn create_test_transport(
@@ -51,32 +38,44 @@ fn create_test_transport(
     let username = local_username.to_owned() + ":" + remote_username;
     let mut connection = transport.add_ice_transport(username.as_str(), &properties)?;
 
-    let (sender, receiver) = oneshot::channel();
-    connection.set_listener(WaitForConnectionListener(Some(sender)));
+    let events = connection.events(16);
 
     Ok(TestTransport {
         transport,
         connection,
-        receiver,
+        events,
     })
 }
 
+async fn wait_for_connection(events: &mut DtlsIceTransportEvents) -> std::result::Result<(), &'static str> {
+    while let Some(event) = events.next().await {
+        if event == DtlsIceTransportEvent::DtlsStateChanged(DtlsIceTransportDtlsState::Connected) {
+            return Ok(());
+        }
+    }
+
+    Err("event stream ended")
+}
+
 fn main() -> Result<()> {
-    media_server::library_init(LoggingLevel::Debug)?;
+    media_server::library_init(LoggingLevel::Debug, DtlsCertificateKeyType::EcdsaP256)?;
 
-    let one = create_test_transport("one", "two", "active")?;
+    let mut one = create_test_transport("one", "two", "active")?;
     let mut two = create_test_transport("two", "one", "passive")?;
 
     two.connection
         .add_remote_candidate("127.0.0.1", one.transport.get_local_port());
 
     futures::executor::block_on(async {
-        let connected = futures::future::try_join(one.receiver, two.receiver);
+        let connected = futures::future::try_join(
+            wait_for_connection(&mut one.events),
+            wait_for_connection(&mut two.events),
+        );
         let timeout = Delay::new(Duration::from_secs(5));
 
-        match futures::future::select(connected, timeout).await {
+        match futures::future::select(Box::pin(connected), timeout).await {
             Either::Left((Ok(_), _)) => Ok(()),
-            Either::Left((Err(_), _)) => Err("failed to read from channel"),
+            Either::Left((Err(e), _)) => Err(e),
             Either::Right(_) => Err("connection timed out"),
         }
     })?;
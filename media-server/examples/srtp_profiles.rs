@@ -0,0 +1,40 @@
+//! Compares single-core SRTP protect / unprotect throughput for each protection profile, at a
+//! typical audio and video packet size.
+//!
+//! AES-GCM goes through OpenSSL (and so AES-NI where available), which is why it is the default
+//! preference for new connections.
+
+use media_server::{DtlsCertificateKeyType, LoggingLevel, Result, SrtpProtectionProfile};
+
+const PACKETS: usize = 200_000;
+
+const PAYLOAD_SIZES: &[usize] = &[160, 1200];
+
+const PROFILES: &[SrtpProtectionProfile] = &[
+    SrtpProtectionProfile::AeadAes128Gcm,
+    SrtpProtectionProfile::AeadAes256Gcm,
+    SrtpProtectionProfile::Aes128CmSha1_80,
+    SrtpProtectionProfile::Aes128CmSha1_32,
+];
+
+fn main() -> Result<()> {
+    media_server::library_init(LoggingLevel::None, DtlsCertificateKeyType::EcdsaP256)?;
+
+    for &payload_size in PAYLOAD_SIZES {
+        for &profile in PROFILES {
+            let throughput = media_server::measure_srtp_throughput(profile, payload_size, PACKETS)?;
+
+            println!(
+                "{:?} ({} bytes): protect {:.0} pps ({:.1} MB/s), unprotect {:.0} pps ({:.1} MB/s)",
+                profile,
+                payload_size,
+                throughput.protect_packets_per_second,
+                throughput.protect_packets_per_second * payload_size as f64 / 1e6,
+                throughput.unprotect_packets_per_second,
+                throughput.unprotect_packets_per_second * payload_size as f64 / 1e6,
+            );
+        }
+    }
+
+    Ok(())
+}
@@ -6,6 +6,15 @@ mod cxx {
 
 use crate::Result;
 
+use std::path::Path;
+use std::pin::Pin;
+use std::sync::Arc;
+use std::task::{Context, Poll};
+
+use futures::channel::oneshot;
+use futures::future::Future;
+use futures::stream::Stream;
+use futures::task::AtomicWaker;
 use parking_lot::{const_mutex, Mutex};
 
 static INIT_MUTEX: Mutex<bool> = const_mutex(false);
@@ -18,7 +27,11 @@ pub enum LoggingLevel {
     UltraDebug,
 }
 
-pub fn library_init(logging: LoggingLevel) -> Result<()> {
+pub type DtlsCertificateKeyType = bridge::DtlsCertificateKeyType;
+
+/// `key_type` is used for the DTLS certificate generated here, unless `use_dtls_certificate` has
+/// been called already.
+pub fn library_init(logging: LoggingLevel, key_type: DtlsCertificateKeyType) -> Result<()> {
     let mut is_init = INIT_MUTEX.lock();
 
     if *is_init {
@@ -35,7 +48,7 @@ pub fn library_init(logging: LoggingLevel) -> Result<()> {
     bridge::openssl_class_init()?;
 
     // It is unfortunate that this is global state.
-    bridge::dtls_connection_initialize()?;
+    bridge::dtls_connection_initialize(key_type)?;
 
     Ok(())
 }
@@ -62,6 +75,37 @@ impl Into<bridge::DtlsConnectionHash> for DtlsConnectionHash {
     }
 }
 
+/// Loads the DTLS certificate from PEM files in `library_init` instead of generating a new one
+/// each time, creating them first if either is missing.
+///
+/// Sharing the files between restarts (or servers) keeps the fingerprint, so SDP answers handed
+/// out earlier stay valid. Generation is guarded by a `.lock` file next to the certificate and the
+/// files are replaced atomically, so servers starting together agree on one pair. Has to be called
+/// before `library_init`.
+pub fn use_dtls_certificate(cert_path: &Path, key_path: &Path, key_type: DtlsCertificateKeyType) -> Result<()> {
+    let is_init = INIT_MUTEX.lock();
+
+    if *is_init {
+        return Err("use_dtls_certificate has to be called before library_init".into());
+    }
+
+    let cert = cert_path.to_str().ok_or("certificate path is not valid UTF-8")?;
+    let key = key_path.to_str().ok_or("key path is not valid UTF-8")?;
+
+    bridge::dtls_connection_ensure_certificate(cert, key, key_type)?;
+
+    bridge::dtls_connection_set_certificate(cert, key);
+
+    Ok(())
+}
+
+/// Measures how many handshakes per second one core can do (both ends) with a certificate of the
+/// given key type, see `examples/dtls_handshakes.rs`.
+pub fn measure_dtls_handshake_rate(key_type: DtlsCertificateKeyType, handshakes: usize) -> Result<f64> {
+    let nanos = bridge::dtls_certificate_handshake_benchmark(key_type, handshakes)?;
+    Ok(handshakes as f64 / (nanos.max(1) as f64 / 1e9))
+}
+
 pub fn get_certificate_fingerprint(hash: DtlsConnectionHash) -> Result<String> {
     let fingerprint = bridge::dtls_connection_get_certificate_fingerprint(hash.into())?;
     Ok(fingerprint)
@@ -74,6 +118,51 @@ pub fn set_port_range(range: Option<(u16, u16)>) -> Result<()> {
     Ok(())
 }
 
+pub type SrtpProtectionProfile = bridge::SrtpProtectionProfile;
+
+#[derive(Debug, Copy, Clone)]
+pub struct SrtpThroughput {
+    pub protect_packets_per_second: f64,
+    pub unprotect_packets_per_second: f64,
+}
+
+/// Measures single-core SRTP protect / unprotect throughput for a profile, see
+/// `examples/srtp_profiles.rs`.
+pub fn measure_srtp_throughput(
+    profile: SrtpProtectionProfile,
+    payload_size: usize,
+    packets: usize,
+) -> Result<SrtpThroughput> {
+    let result = bridge::srtp_benchmark(profile, payload_size, packets)?;
+    let per_second = |nanos: u64| packets as f64 / (nanos.max(1) as f64 / 1e9);
+
+    Ok(SrtpThroughput {
+        protect_packets_per_second: per_second(result.protect_nanos),
+        unprotect_packets_per_second: per_second(result.unprotect_nanos),
+    })
+}
+
+/// Resolves once everything already queued for teardown when this is called has been torn down.
+///
+/// Dropping any of the wrappers below never blocks, the native objects are removed from their
+/// event loops on a background thread instead. Objects are only queued once nothing else holds
+/// them: a source group still used by a transponder, tap or pending keyframe switch is released
+/// with that, and releases that first have to go through an event loop may be queued after this
+/// resolves. A transport's port is only free once all of its connections have been released too.
+pub fn teardown_flush() -> impl Future<Output = ()> {
+    let (sender, receiver) = oneshot::channel();
+
+    let completion = bridge::TeardownCompletionRustAdapter::from(move || {
+        let _ = sender.send(());
+    });
+    bridge::teardown_flush(Box::new(completion));
+
+    async move {
+        // The sender can only be dropped without sending if the completion was never run.
+        let _ = receiver.await;
+    }
+}
+
 pub struct Properties(cxx::UniquePtr<bridge::PropertiesFacade>);
 
 impl Properties {
@@ -92,6 +181,33 @@ impl Properties {
     pub fn set_string(&mut self, key: &str, value: &str) {
         self.0.pin_mut().set_string(key, value);
     }
+
+    /// The properties `add_ice_transport_with_parameters` configures a connection with, to inspect
+    /// them or to add keys the typed parameters don't cover before using `add_ice_transport`.
+    pub fn from_ice_transport_parameters(parameters: &IceTransportParameters) -> Self {
+        Self(bridge::new_ice_transport_properties(parameters))
+    }
+
+    /// The properties `set_remote_rtp_parameters` / `set_local_rtp_parameters` pass on, see
+    /// `from_ice_transport_parameters`.
+    pub fn from_rtp_parameters(audio: &RtpMediaParameters, video: &RtpMediaParameters) -> Self {
+        Self(bridge::new_rtp_properties(audio, video))
+    }
+
+    /// Errors if the key is not set.
+    pub fn get_int(&self, key: &str) -> Result<i32> {
+        Ok(self.0.get_int(key)?)
+    }
+
+    /// Errors if the key is not set.
+    pub fn get_bool(&self, key: &str) -> Result<bool> {
+        Ok(self.0.get_bool(key)?)
+    }
+
+    /// Errors if the key is not set.
+    pub fn get_string(&self, key: &str) -> Result<String> {
+        Ok(self.0.get_string(key)?)
+    }
 }
 
 impl Default for Properties {
@@ -100,17 +216,209 @@ impl Default for Properties {
     }
 }
 
-pub use bridge::DtlsIceTransportListener;
+pub type IceTransportParameters<'a> = bridge::IceTransportParameters<'a>;
+
+pub type RtpCodecParameters<'a> = bridge::RtpCodecParameters<'a>;
+
+pub type RtpExtensionParameters<'a> = bridge::RtpExtensionParameters<'a>;
+
+pub type RtpMediaParameters<'a> = bridge::RtpMediaParameters<'a>;
 
 pub type DtlsIceTransportDtlsState = bridge::DtlsIceTransportDtlsState;
 
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum DtlsIceTransportEvent {
+    IceTimeout,
+    DtlsStateChanged(DtlsIceTransportDtlsState),
+    RemoteIceCandidateActivated { ip: String, port: u16, priority: u32 },
+}
+
+pub type DtlsIceTransportEventQueueStats = bridge::DtlsIceTransportEventQueueStats;
+
+struct AtomicWakerNotifier(Arc<AtomicWaker>);
+
+impl bridge::DtlsIceTransportEventNotifier for AtomicWakerNotifier {
+    fn notify(&self) {
+        self.0.wake();
+    }
+}
+
+/// Stream of events for a `RtpBundleTransportConnection`.
+///
+/// Events are queued by the media event loop and only read when this stream is polled, so a slow
+/// consumer never holds up packet processing. If the queue fills up new events are dropped,
+/// `get_stats` can be used to check if the queue needs to be bigger.
+///
+/// The stream ends once the connection is dropped or its events are handed to a new stream.
+pub struct DtlsIceTransportEvents {
+    queue: cxx::UniquePtr<bridge::DtlsIceTransportEventQueueFacade>,
+    waker: Arc<AtomicWaker>,
+    event: bridge::DtlsIceTransportEvent,
+}
+
+impl DtlsIceTransportEvents {
+    pub fn get_stats(&self) -> DtlsIceTransportEventQueueStats {
+        self.queue.get_stats()
+    }
+
+    fn pop_event(&mut self) -> Option<DtlsIceTransportEvent> {
+        if !self.queue.pin_mut().pop_event(&mut self.event) {
+            return None;
+        }
+
+        let event = match self.event.kind {
+            bridge::DtlsIceTransportEventKind::IceTimeout => DtlsIceTransportEvent::IceTimeout,
+            bridge::DtlsIceTransportEventKind::DtlsStateChanged => {
+                DtlsIceTransportEvent::DtlsStateChanged(self.event.dtls_state)
+            }
+            bridge::DtlsIceTransportEventKind::RemoteIceCandidateActivated => {
+                DtlsIceTransportEvent::RemoteIceCandidateActivated {
+                    ip: std::mem::take(&mut self.event.ip),
+                    port: self.event.port,
+                    priority: self.event.priority,
+                }
+            }
+            _ => unreachable!("unknown dtls ice transport event kind"),
+        };
+
+        Some(event)
+    }
+}
+
+impl Stream for DtlsIceTransportEvents {
+    type Item = DtlsIceTransportEvent;
+
+    fn poll_next(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
+        let this = self.get_mut();
+
+        if let Some(event) = this.pop_event() {
+            return Poll::Ready(Some(event));
+        }
+
+        // Register before checking again so we can't miss an event pushed in between.
+        this.waker.register(cx.waker());
+
+        // Checked before popping, so events pushed before the queue closed are still returned.
+        let closed = this.queue.is_closed();
+
+        match this.pop_event() {
+            Some(event) => Poll::Ready(Some(event)),
+            None if closed => Poll::Ready(None),
+            None => Poll::Pending,
+        }
+    }
+}
+
 pub type MediaFrameType = bridge::MediaFrameType;
 
+pub type RtpIncomingSourceGroupParameters<'a> = bridge::RtpIncomingSourceGroupParameters<'a>;
+
+pub type RtpOutgoingSourceGroupParameters<'a> = bridge::RtpOutgoingSourceGroupParameters<'a>;
+
+pub type RtpLayerSelection = bridge::RtpLayerSelection;
+
+pub type KeyframeRequestStats = bridge::KeyframeRequestStats;
+
+pub type RtpStreamTransponderSwitchStats = bridge::RtpStreamTransponderSwitchStats;
+
+pub use bridge::RtpPacketListener;
+
+/// A packet passed to a `RtpPacketListener`, only valid for the duration of the callback.
+pub type RtpPacketView = bridge::RtpPacketFacade;
+
+/// A packet kept alive after a `RtpPacketListener` callback, sharing the buffer with media-server.
+pub struct RtpPacket(cxx::UniquePtr<bridge::RtpPacketFacade>);
+
+impl RtpPacket {
+    pub fn retain(packet: &RtpPacketView) -> Self {
+        Self(packet.retain())
+    }
+}
+
+impl std::ops::Deref for RtpPacket {
+    type Target = RtpPacketView;
+
+    fn deref(&self) -> &Self::Target {
+        &self.0
+    }
+}
+
+/// Keeps a `RtpPacketListener` attached to a source group until dropped.
+pub struct RtpPacketTap(cxx::UniquePtr<bridge::RtpPacketTapFacade>);
+
+pub use bridge::MediaFrameListener;
+
+/// A frame passed to a `MediaFrameListener`, only valid for the duration of the callback.
+pub type MediaFrameView = bridge::MediaFrameFacade;
+
+/// A copy of a frame kept after a `MediaFrameListener` callback, its buffer returns to the
+/// stream's pool when dropped.
+pub struct MediaFrame(cxx::UniquePtr<bridge::MediaFrameFacade>);
+
+impl MediaFrame {
+    pub fn retain(frame: &MediaFrameView) -> Self {
+        Self(frame.retain())
+    }
+}
+
+impl std::ops::Deref for MediaFrame {
+    type Target = MediaFrameView;
+
+    fn deref(&self) -> &Self::Target {
+        &self.0
+    }
+}
+
+/// Keeps a `MediaFrameListener` and its depacketizer attached to a source group until dropped.
+pub struct MediaFrameTap(cxx::UniquePtr<bridge::MediaFrameTapFacade>);
+
 pub struct RtpIncomingSourceGroup(cxx::UniquePtr<bridge::RtpIncomingSourceGroupFacade>);
 
+impl RtpIncomingSourceGroup {
+    pub fn add_packet_listener(&mut self, listener: impl RtpPacketListener + 'static) -> RtpPacketTap {
+        let listener = bridge::RtpPacketListenerRustAdapter::from(listener);
+        RtpPacketTap(self.0.pin_mut().add_packet_listener(Box::new(listener)))
+    }
+
+    pub fn add_media_frame_listener(&mut self, listener: impl MediaFrameListener + 'static) -> MediaFrameTap {
+        let listener = bridge::MediaFrameListenerRustAdapter::from(listener);
+        MediaFrameTap(self.0.pin_mut().add_media_frame_listener(Box::new(listener)))
+    }
+
+    /// Caches the most recent keyframe (and the delta frames since, up to `max_packets` packets)
+    /// and replays it to transponders attached with `set_incoming`, so they don't wait on a PLI.
+    pub fn enable_keyframe_cache(&mut self, max_packets: usize) {
+        self.0.pin_mut().enable_keyframe_cache(max_packets);
+    }
+
+    /// Sets how often keyframe requests from this source group's transponders may be forwarded to
+    /// the publisher (500ms by default). Requests in between are merged into a single request sent
+    /// when the interval is over.
+    pub fn set_keyframe_request_interval(&mut self, min_interval: std::time::Duration) {
+        let min_interval_ms = min_interval.as_millis().min(u32::MAX as u128) as u32;
+        self.0.pin_mut().set_keyframe_request_interval(min_interval_ms);
+    }
+
+    pub fn get_keyframe_request_stats(&self) -> KeyframeRequestStats {
+        self.0.get_keyframe_request_stats()
+    }
+
+    /// Drops this source group and waits for everything already queued for teardown, see `teardown_flush`.
+    pub fn close(self) -> impl Future<Output = ()> {
+        drop(self);
+        teardown_flush()
+    }
+}
+
 pub struct RtpOutgoingSourceGroup(cxx::UniquePtr<bridge::RtpOutgoingSourceGroupFacade>);
 
 impl RtpOutgoingSourceGroup {
+    /// Drops this source group and waits for everything already queued for teardown, see `teardown_flush`.
+    pub fn close(self) -> impl Future<Output = ()> {
+        drop(self);
+        teardown_flush()
+    }
+
     pub fn add_transponder(&mut self) -> RtpStreamTransponder {
         RtpStreamTransponder(self.0.pin_mut().add_transponder())
     }
@@ -119,17 +427,67 @@ impl RtpOutgoingSourceGroup {
 pub struct RtpStreamTransponder(cxx::UniquePtr<bridge::RtpStreamTransponderFacade>);
 
 impl RtpStreamTransponder {
+    /// Drops this transponder and waits for everything already queued for teardown, see `teardown_flush`.
+    pub fn close(self) -> impl Future<Output = ()> {
+        drop(self);
+        teardown_flush()
+    }
+
     pub fn set_incoming(&mut self, incoming: &mut RtpIncomingSourceGroup) {
         self.0.pin_mut().set_incoming(incoming.0.pin_mut());
     }
+
+    /// Keeps forwarding the current source until `incoming` produces a keyframe, requesting one
+    /// from it, then cuts over without the receiver having to wait for a keyframe itself.
+    pub fn set_incoming_on_keyframe(&mut self, incoming: &mut RtpIncomingSourceGroup) {
+        self.0.pin_mut().set_incoming_on_keyframe(incoming.0.pin_mut());
+    }
+
+    pub fn get_switch_stats(&self) -> RtpStreamTransponderSwitchStats {
+        self.0.get_switch_stats()
+    }
+
+    /// Forwards only the given simulcast / SVC layers, `RtpLayerSelection::ALL` forwards everything.
+    pub fn select_layer(&mut self, layers: RtpLayerSelection) {
+        self.0
+            .pin_mut()
+            .select_layer(layers.spatial_layer_id, layers.temporal_layer_id);
+    }
+
+    /// Caps the layers that can be forwarded regardless of the selected layer.
+    pub fn set_maximum_layers(&mut self, layers: RtpLayerSelection) {
+        self.0
+            .pin_mut()
+            .set_maximum_layers(layers.spatial_layer_id, layers.temporal_layer_id);
+    }
+
+    /// The layers currently being forwarded, which only follow `select_layer` once the stream
+    /// reaches a point where the layer can be switched.
+    pub fn get_current_layers(&self) -> RtpLayerSelection {
+        self.0.get_current_layers()
+    }
 }
 
 pub struct RtpBundleTransportConnection(cxx::UniquePtr<bridge::RtpBundleTransportConnectionFacade>);
 
 impl RtpBundleTransportConnection {
-    pub fn set_listener(&mut self, listener: impl DtlsIceTransportListener + 'static) {
-        let listener = bridge::DtlsIceTransportListenerRustAdapter::from(listener);
-        self.0.pin_mut().set_listener(Box::new(listener));
+    /// Drops this connection and waits for everything already queued for teardown, see `teardown_flush`.
+    pub fn close(self) -> impl Future<Output = ()> {
+        drop(self);
+        teardown_flush()
+    }
+
+    /// Starts queueing events for this connection, ending any previous stream.
+    pub fn events(&mut self, capacity: usize) -> DtlsIceTransportEvents {
+        let waker = Arc::new(AtomicWaker::new());
+        let notifier = bridge::DtlsIceTransportEventNotifierRustAdapter::from(AtomicWakerNotifier(waker.clone()));
+        let queue = self.0.pin_mut().set_event_queue(capacity, Box::new(notifier));
+
+        DtlsIceTransportEvents {
+            queue,
+            waker,
+            event: Default::default(),
+        }
     }
 
     pub fn set_remote_properties(&mut self, properties: &Properties) {
@@ -140,6 +498,16 @@ impl RtpBundleTransportConnection {
         self.0.pin_mut().set_local_properties(&properties.0);
     }
 
+    /// Typed equivalent of `set_remote_properties`, without building a key for each value.
+    pub fn set_remote_rtp_parameters(&mut self, audio: &RtpMediaParameters, video: &RtpMediaParameters) {
+        self.0.pin_mut().set_remote_rtp_parameters(audio, video);
+    }
+
+    /// Typed equivalent of `set_local_properties`, without building a key for each value.
+    pub fn set_local_rtp_parameters(&mut self, audio: &RtpMediaParameters, video: &RtpMediaParameters) {
+        self.0.pin_mut().set_local_rtp_parameters(audio, video);
+    }
+
     pub fn add_incoming_source_group(
         &mut self,
         kind: MediaFrameType,
@@ -174,6 +542,28 @@ impl RtpBundleTransportConnection {
         Ok(RtpOutgoingSourceGroup(outgoing_source_group))
     }
 
+    /// Adds all of the source groups with a single trip to the event loop, which is much cheaper
+    /// than calling `add_incoming_source_group` and `add_outgoing_source_group` for each one.
+    ///
+    /// Unlike the individual calls an unset mid, rid, or ssrc is passed as an empty string or 0.
+    pub fn add_source_groups(
+        &mut self,
+        incoming: &[RtpIncomingSourceGroupParameters],
+        outgoing: &[RtpOutgoingSourceGroupParameters],
+    ) -> Result<(Vec<RtpIncomingSourceGroup>, Vec<RtpOutgoingSourceGroup>)> {
+        let mut batch = self.0.pin_mut().add_source_groups(incoming, outgoing)?;
+
+        let incoming_source_groups = (0..batch.get_incoming_count())
+            .map(|i| Ok(RtpIncomingSourceGroup(batch.pin_mut().take_incoming(i)?)))
+            .collect::<Result<Vec<_>>>()?;
+
+        let outgoing_source_groups = (0..batch.get_outgoing_count())
+            .map(|i| Ok(RtpOutgoingSourceGroup(batch.pin_mut().take_outgoing(i)?)))
+            .collect::<Result<Vec<_>>>()?;
+
+        Ok((incoming_source_groups, outgoing_source_groups))
+    }
+
     pub fn add_remote_candidate(&mut self, ip: &str, port: u16) {
         self.0.pin_mut().add_remote_candidate(ip, port);
     }
@@ -188,10 +578,20 @@ impl RtpBundleTransport {
         Ok(Self(transport))
     }
 
+    /// Drops this transport and waits for everything already queued for teardown, see `teardown_flush`.
+    pub fn close(self) -> impl Future<Output = ()> {
+        drop(self);
+        teardown_flush()
+    }
+
     pub fn get_local_port(&self) -> u16 {
         self.0.get_local_port()
     }
 
+    pub fn get_connection_count(&self) -> usize {
+        self.0.get_connection_count()
+    }
+
     pub fn add_ice_transport(
         &mut self,
         username: &str,
@@ -200,4 +600,62 @@ impl RtpBundleTransport {
         let connection = self.0.pin_mut().add_ice_transport(username, &properties.0)?;
         Ok(RtpBundleTransportConnection(connection))
     }
+
+    pub fn add_ice_transport_with_parameters(
+        &mut self,
+        username: &str,
+        parameters: &IceTransportParameters,
+    ) -> Result<RtpBundleTransportConnection> {
+        let connection = self
+            .0
+            .pin_mut()
+            .add_ice_transport_with_parameters(username, parameters)?;
+        Ok(RtpBundleTransportConnection(connection))
+    }
+}
+
+pub type RtpBundleTransportShardStats = bridge::RtpBundleTransportShardStats;
+
+/// A set of `RtpBundleTransport`s, one per core by default, that connections are spread across.
+///
+/// Each ICE username always maps to the same shard, use `get_local_port` to find the port that
+/// needs to be advertised as the ICE candidate for a given username. The pool can be shared between
+/// threads as-is, connections are added under a per-shard lock.
+pub struct RtpBundleTransportPool(cxx::UniquePtr<bridge::RtpBundleTransportPoolFacade>);
+
+impl RtpBundleTransportPool {
+    pub fn new(shard_count: Option<usize>) -> Result<Self> {
+        let shard_count = shard_count.unwrap_or(0);
+        let pool = bridge::new_rtp_bundle_transport_pool(shard_count)?;
+        Ok(Self(pool))
+    }
+
+    pub fn get_shard_count(&self) -> usize {
+        self.0.get_shard_count()
+    }
+
+    pub fn get_local_port(&self, username: &str) -> u16 {
+        let shard = self.0.get_shard_for_username(username);
+
+        // The shard index comes straight from the pool, so it is always in range.
+        self.0.get_shard_local_port(shard).unwrap()
+    }
+
+    pub fn get_shard_stats(&self) -> Vec<RtpBundleTransportShardStats> {
+        self.0.get_shard_stats()
+    }
+
+    pub fn add_ice_transport(&self, username: &str, properties: &Properties) -> Result<RtpBundleTransportConnection> {
+        let connection = self.0.add_ice_transport(username, &properties.0)?;
+        Ok(RtpBundleTransportConnection(connection))
+    }
+
+    pub fn add_ice_transport_with_parameters(
+        &self,
+        username: &str,
+        parameters: &IceTransportParameters,
+    ) -> Result<RtpBundleTransportConnection> {
+        let connection = self.0.add_ice_transport_with_parameters(username, parameters)?;
+        Ok(RtpBundleTransportConnection(connection))
+    }
 }